@@ -0,0 +1,118 @@
+#!/bin/sh
+#
+# Load benchmark, run by 'make benchmark' (as root). Pinger probes HOSTS
+# addresses in 127.0.0.0/8 inside a fresh network namespace, where the
+# responder answers them after DELAY ms plus up to JITTER ms, and drops
+# LOSS percent. After a warmup of two rounds it measures for DURATION
+# seconds and prints the results as JSON:
+#
+#  pps		echo requests (and replies) per second that were achieved
+#  lateness	how late send_next() ran on its schedule over the measurement:
+#		the mean, and quantiles from the histogram buckets that
+#		filled up in between (the upper bounds of the buckets)
+#  rtt		mean RTT and its error against the delay the responder gave
+#		the replies, not counting how late the responder itself was
+#  loss		loss seen by pinger, against what the responder dropped
+#
+# For example: make benchmark HOSTS=10000 INTERVAL=2 DELAY=5 JITTER=1
+
+HOSTS=${HOSTS:-5000}
+INTERVAL=${INTERVAL:-1}
+DURATION=${DURATION:-30}
+DELAY=${DELAY:-10}
+JITTER=${JITTER:-0}
+LOSS=${LOSS:-0}
+SHARDS=${SHARDS:-1}
+
+BIN=$(cd "$(dirname "$0")" && pwd)
+NS=pingerbench$$
+DIR=$(mktemp -d)
+
+cleanup() {
+  [ -n "$PINGER" ] && kill $PINGER 2>/dev/null
+  [ -n "$RESPONDER" ] && kill $RESPONDER 2>/dev/null
+  wait 2>/dev/null
+  ip netns del $NS 2>/dev/null
+  rm -rf "$DIR"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+ip netns add $NS || exit 1
+ip -n $NS link set lo up
+ip netns exec $NS sysctl -qw net.ipv4.icmp_echo_ignore_all=1	# only the responder answers
+
+awk -v n=$HOSTS 'BEGIN { for (i = 0; i < n; i++) printf("127.%d.%d.%d\n", 1+int(i/62500), int(i/250)%250, i%250+1) }' > "$DIR/targets"
+
+ip netns exec $NS "$BIN/responder" -d $DELAY -j $JITTER -l $LOSS > "$DIR/responder.json" &
+RESPONDER=$!
+cd "$DIR"
+ip netns exec $NS "$BIN/pinger" --headless --interval $INTERVAL --shards $SHARDS --metrics "$DIR/metrics" > "$DIR/pinger.out" 2>&1 &
+PINGER=$!
+
+scrape() {	# waits for a fresh snapshot, so the time it was taken is known
+  prev=$(curl -s --unix-socket "$DIR/metrics" http://pinger/metrics | grep '^pinger_packets_total{direction="tx"}')
+  while :; do
+    curl -s --unix-socket "$DIR/metrics" http://pinger/metrics > "$1"
+    [ "$(grep '^pinger_packets_total{direction="tx"}' "$1")" != "$prev" ] && break
+    sleep 0.05
+  done
+  date +%s.%N
+}
+
+for i in $(seq 100); do
+  [ -S "$DIR/metrics" ] && break
+  sleep 0.1
+done
+[ -S "$DIR/metrics" ] || { cat "$DIR/pinger.out" >&2; exit 1; }
+sleep $((2*INTERVAL))
+T1=$(scrape "$DIR/before")
+sleep $DURATION
+T2=$(scrape "$DIR/after")
+
+kill $PINGER $RESPONDER
+wait $PINGER $RESPONDER 2>/dev/null
+PINGER= RESPONDER=
+
+awk -v t1=$T1 -v t2=$T2 -v hosts=$HOSTS -v interval=$INTERVAL -v shards=$SHARDS \
+    -v delay=$DELAY -v jitter=$JITTER -v loss=$LOSS -v responder="$(cat "$DIR/responder.json")" '
+  function value(line) { sub(/.* /, "", line); return line+0 }
+  FNR == 1 { file++ }
+  /^pinger_packets_total\{direction="tx"\}/ { tx[file] = value($0) }
+  /^pinger_packets_total\{direction="rx"\}/ { rx[file] = value($0) }
+  /^pinger_probes_total\{/ { probes[file] += value($0) }
+  /^pinger_probes_lost_total\{/ { lost[file] += value($0) }
+  /^pinger_rtt_seconds_sum\{/ { rttsum[file] += value($0) }
+  /^pinger_rtt_seconds_count\{/ { rttcount[file] += value($0) }
+  /^pinger_send_lateness_seconds_bucket\{le="[0-9]/ {	# cumulative, so each bucket is the step from the previous line
+    le = $0; sub(/.*le="/, "", le); sub(/".*/, "", le)
+    c = value($0)
+    late[le] += (file == 2?1:-1)*(c-prevcum[file])
+    prevcum[file] = c
+    if (!(le in late_seen)) { late_seen[le] = 1; les[++nles] = le }
+  }
+  /^pinger_send_lateness_seconds_(sum|count)/ { split($0, f, " "); if ($1 ~ /sum$/) latesum[file] = f[2]; else latecount[file] = f[2] }
+  function quantile(q,    i, sum, rank) {	# of the lateness buckets that filled up in between, in us
+    rank = q*lc; if (rank < 1) rank = 1
+    for (i = 1; i <= nles; i++) if ((sum += late[les[i]]) >= rank) return les[i]*1e6
+    return 0
+  }
+  END {
+    for (i = 2; i <= nles; i++) {	# the two scrapes may not have the same buckets
+      for (j = i; (j > 1) && (les[j-1]+0 > les[j]+0); j--) { le = les[j]; les[j] = les[j-1]; les[j-1] = le }
+    }
+    t = t2-t1
+    n = rttcount[2]-rttcount[1]
+    mean = n?(rttsum[2]-rttsum[1])/n*1000:0
+    expect = delay+jitter/2
+    rlate = match(responder, /"late_us": [0-9.]+/)?substr(responder, RSTART+11, RLENGTH-11)/1000:0
+    p = probes[2]-probes[1]
+    lc = latecount[2]-latecount[1]
+    printf("{\n  \"hosts\": %d, \"interval_s\": %d, \"shards\": %d, \"duration_s\": %.3f,\n", hosts, interval, shards, t)
+    printf("  \"responder\": { \"delay_ms\": %g, \"jitter_ms\": %g, \"loss_pct\": %g, \"stats\": %s },\n", delay, jitter, loss, responder)
+    printf("  \"pps\": { \"target\": %.1f, \"tx\": %.1f, \"rx\": %.1f },\n", hosts/interval, (tx[2]-tx[1])/t, (rx[2]-rx[1])/t)
+    printf("  \"lateness_us\": { \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f },\n",
+      lc?(latesum[2]-latesum[1])/lc*1e6:0, quantile(0.5), quantile(0.9), quantile(0.99), quantile(0.999))
+    printf("  \"rtt_ms\": { \"expected\": %.3f, \"mean\": %.3f, \"error_us\": %.1f, \"replies\": %d },\n", expect, mean, (mean-expect-rlate)*1000, n)
+    printf("  \"loss_pct\": %.3f\n}\n", p?(lost[2]-lost[1])*100/p:0)
+  }' "$DIR/before" "$DIR/after"
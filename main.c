@@ -1,3 +1,4 @@
+#define _GNU_SOURCE			// sendmmsg(), recvmmsg()
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -6,6 +7,8 @@
 #include <time.h>
 #include <math.h>
 #include <string.h>
+#include <limits.h>
+#include <getopt.h>
 #include <ctype.h>
 #include <locale.h>
 #include <ncurses.h>
@@ -13,40 +16,112 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/time.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/timerfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <netinet/ip_icmp.h>
 #include <netinet/icmp6.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/filter.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <pthread.h>
 #include <sys/prctl.h>		// debug
 
-#define INITWAIT       5		/* Seconds to show initialisation messages before going visual */
 #define GRIDMARK    '+'
 #define TARGETSFILE	"targets"
-#define INTERVAL	    60
+#define HISTFILE	"pinger.hist"	/* History and per-host state, kept across restarts */
+#define HISTMAGIC	"PINGHIST"
+#define HISTVERSION	     1
+#define LOGMAGIC	"PINGLOG1"	/* Results log, see the REC_ defines for the format */
+#define LOGBUFSIZE	 65536		/* Results are buffered and written out every LOGFLUSH ms, or when this fills up */
+#define LOGFLUSH	  1000
+#define METRICSREFRESH	  5000		/* Milliseconds between rebuilds of the metrics snapshot */
+#define METRICSCHUNK	    64		/* Hosts added to a snapshot being built per timer tick */
+#define MAXCLIENTS	    16		/* Metrics connections served at the same time */
+#define CLIENTTIMEOUT	  5000		/* Milliseconds a metrics client gets to send its request and read the reply */
+#define INTERVAL	    60		/* Seconds per ping round, see --interval */
+#define TIMEOUT		  2000		/* Max milliseconds to wait for an echo reply before counting a probe as lost */
+#define RTOMIN		   250		/* Min milliseconds to wait; in between, each host's own RTT decides, see update_rto() */
+#define RTOGRAIN	  1000		/* Microseconds; the least margin an RTO gets above the smoothed RTT */
+#define MAXINFLIGHT	  4096		/* Size of the in-flight probe table; must divide 65536 */
+#define WHEELBITS	     6		/* Timing wheel: 2^WHEELBITS slots per level */
+#define WHEELLEVELS	     5		/* Timing wheel: levels, covering 2^(WHEELBITS*WHEELLEVELS) ms */
+#define MAXEVENTS	    16
+#define BATCHSIZE	    64		/* Max packets per sendmmsg()/recvmmsg() call */
+#define RINGSIZE	  8192		/* Records queued between a worker thread and the main thread; power of 2 */
+#define MAXSHARDS	    64		/* Max worker threads, see --shards */
+#define RESOLVERS	    16		/* Threads doing DNS lookups at the same time */
+#define RESOLVEMERGE	   250		/* Milliseconds the hosts whose names came in after the start wait to be added together */
+#define MAXTRAIN	    32		/* Max echoes in a packet train, see "train=" in the targets file */
+#define TRAINSIZES	     8		/* Max payload sizes a train cycles through */
+#define TRAINMAXSIZE	  4000		/* Max bytes of ICMP payload of a train packet */
+#define TRAINGAP	     0		/* Milliseconds between the packets of a train, 0 is back to back; see --traingap */
 #define HISTLOG		   100		/* Number of intervals to keep full data from in memory */
 #define SCROLLSIZE    10
+#define FRAMERATE	    10		/* Max screen updates per second, can be changed with --fps */
+#define WINORDER	"hfagstdi"	/* header, footer, status, grid, scroller, tree, downlist, hostinfo */
+#define DIRTY_TOUCH	 0x100		/* Repaint every window completely */
 #define LINEBUF		   512
 #define HOSTLEN		    64
 #define MAXPACKET	  4096		/* max packet size */
 #define IDSEQUENCE	"ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+#define IDLEN		     4		/* Max characters in a host id; all ids get as many as the number of hosts needs */
 #define LEARNROUNDS    5		/* number of INTERVALS to wait before marking any result as lagged */
 #define JITMULT		     3		/* Sensitive: 2 */
 #define LAGMULT		    10		/* Sensitive: 10 */
 #define LAGMIN		     8		/* Currently unused */
+#define AMPLMIN		  1000		/* Microseconds; lower bound for the jitter amplitude used above */
+#define CMSGSIZE	   256		/* Room for the ancillary data (timestamps) of one packet */
+#define JITQUANT	  0.90		/* Replies within this quantile of a host's RTTs are never marked as jitter */
+#define BASEWEIGHT	    16		/* The baseline follows the ok replies as an EWMA of this weight */
+#define CUSUMK		   0.5		/* CUSUM slack, in deviations of the baseline; see track_baseline() */
+#define CUSUMH		    10		/* CUSUM level at which the baseline is moved */
+#define CUSUMCLIP	     4		/* Max deviations one reply adds, so a single spike can't move the baseline */
+#define SKETCHSUB	    16		/* Quantile sketch: linear sub-buckets per power of 2, ~3% error */
+#define SKETCHBUCKETS	(2*SKETCHSUB+(32-5)*SKETCHSUB)
 
 #define STATE_OK	     3
 #define STATE_JIT	     4
 #define STATE_LAG	     5
 #define STATE_LOSS	   6
 
+#define REC_SESSION	   1		/* Results log records: a type byte, then LEB128 varints and strings (length, bytes). Time in us since the epoch */
+#define REC_TARGET	   2		/* Number (only valid within its session), address, name. Results use their STATE_: time delta (zigzag), number, RTT (not for STATE_LOSS) */
+#define REC_LATE	   7		/* As a result, for a reply to a probe that was logged as lost */
+#define SEQWINDOW	    64		/* Probes per host of which duplicate and reordered replies are recognised */
+#define SEQ_INORDER	   0		/* What seq_order() makes of a reply */
+#define SEQ_REORDERED	   1
+#define SEQ_DUPLICATE	   2
+#define SEQ_OLD		   3
+
+typedef struct timer {
+  struct timer *next, *prev;	// next is NULL when the timer isn't pending
+  unsigned long expires;	// CLOCK_MONOTONIC milliseconds
+  void (*func)(struct timer *);
+} timer;
+
+typedef struct wheel {
+  unsigned long now;		// next tick to be processed
+  timer slot[WHEELLEVELS][1<<WHEELBITS];	// list heads
+} wheel;
+
+wheel timers;
+
 typedef struct pingdata {
-  unsigned int rtt;
+  unsigned int rtt;		// all round trip times are in microseconds
   int color;
 } pingdata;
 
 typedef struct passdata {
-  time_t time;
   pingdata *data;
 } passdata;
 
@@ -64,20 +139,32 @@ typedef struct logdata {
   float stddev;
 } logdata;
 
-typedef struct target {
-  int num;
-  char id;
-  char name[HOSTLEN+1];
-  char ipstr[INET6_ADDRSTRLEN+1];
-  struct sockaddr_storage *addr;
-  int rank;
-  int detached;
+typedef struct sketch {		// log-linear histogram of RTTs, like HDR histogram
+  unsigned int total;
+  unsigned int count[SKETCHBUCKETS];
+} sketch;
+
+typedef struct window {		// aggregates over the samples currently in histlog
+  unsigned int count;		// results, losses included
+  unsigned int losscount;
+  unsigned int delaycount;
+  unsigned int okcount;
+  unsigned long oksum;
+  unsigned int n;		// replies
+  double mean, m2;		// Welford's running mean and sum of squared deviations
+  int minq[HISTLOG], maxq[HISTLOG];	// monotonic deques of ping rounds, oldest first
+  int minhead, minlen, maxhead, maxlen;
+  sketch quant;
+} window;
+
+typedef struct statedata {	// per-host cumulative state, kept in the history file
+  char ipstr[INET6_ADDRSTRLEN+1];	// to find a host's record again after a restart
   int lastcolor;
   int treecolor;
   int beepmode;		// 0 = normal, 1 = reverse, 2 = off
   unsigned long rttsum;
   unsigned long oksum;
-  unsigned long sqsum;
+  double sqsum;
   unsigned int rttavg;
   unsigned int okavg;
   unsigned int rttmin;
@@ -86,62 +173,508 @@ typedef struct target {
   unsigned int okcount;
   unsigned int delaycount;
   unsigned int losscount;
+  unsigned int probecount;
   time_t downsince;
+  unsigned int srtt;		// smoothed RTT and its mean deviation, as TCP does (RFC 6298)
+  unsigned int rttvar;
+  unsigned int rto;		// microseconds to wait for the next reply
+  unsigned int latecount;	// replies that came after their probe was counted as lost
+  unsigned int dupcount;
+  unsigned int reordercount;	// replies that came after the reply to a later probe
+  unsigned int okdev;		// mean deviation of the ok replies from okavg
+  double cusumhi, cusumlo;	// evidence of a level shift up or down, see track_baseline()
+  unsigned long hisum, losum;	// replies since each of those was last 0
+  unsigned int hin, lon;
+  unsigned int rebaselines;
+  sketch quant;
+} statedata;
+
+typedef struct histheader {	// layout: histheader, statedata[capacity], pingdata[HISTLOG][capacity]
+  char magic[8];
+  unsigned int version;
+  unsigned int histlog;
+  unsigned int statesize, pingsize;	// to notice layout changes
+  unsigned int capacity;
+  unsigned int ntargets;
+  int currlog;
+  int pinground;
+  time_t passtime[HISTLOG];
+} histheader;
+
+histheader *hist;
+size_t histsize;
+
+typedef struct train {		// packet train settings and results of a host, see start_train()
+  timer timer;			// paces the packets; must be the first member
+  struct target *target;
+  int len, nsizes;		// echoes per train, and the payload sizes they cycle through
+  unsigned short sizes[TRAINSIZES];
+  int next, left;		// packets of the current train sent, and still without a result
+  unsigned int done;		// one bit for each packet with a result
+  unsigned int gen;		// tells its packets from those of earlier trains
+  unsigned int rtt[MAXTRAIN];	// results of the current train, UINT_MAX when lost
+  unsigned long trains, packets, lost;
+  unsigned int lastlost;	// packets lost in the latest train
+  double jitter;		// RFC 3550 interarrival jitter, microseconds
+  unsigned int sizertt[TRAINSIZES];	// smoothed RTT for each payload size
+} train;
+
+typedef struct subtree {	// sums over a host and the hosts behind it in the tree
+  unsigned int hosts;
+  unsigned int down;
+  unsigned int losing;		// hosts whose latest probe was lost
+  unsigned int replied;		// hosts that have replied at least once
+  long excess;			// their latest RTT above their fastest one, microseconds
+} subtree;
+
+typedef struct target {
+  int num;
+  char id[IDLEN+1];
+  char name[HOSTLEN+1];
+  char ipstr[INET6_ADDRSTRLEN+1];
+  char *host;			// as written in the targets file
+  struct sockaddr_storage *addr;
+  int rank;
+  int detached;
+  int treey, treex;		// position in the network map
+  int treeline;			// row where the connector from the parent starts
+  struct target *parent;	// nearest previous host with a lower rank
+  struct target *lastkid;
+  subtree own, sub;		// what this host adds to the sums, and the sums of its subtree
+  int lastround;		// ping round of the latest probe, for the grid
+  unsigned int tseq;		// number of the next regular probe of this host
+  unsigned long long seqwin;	// bit n is set once probe tseq-1-n was answered
+  int gone;			// dropped from the targets file, being cleaned up
+  statedata *st;		// lives in the history file
+  window win;
+  char *labels;			// Prometheus labels identifying the host
   char *comment;
+  train *train;			// NULL unless the targets file asks for packet trains
   struct target *next;
-  int waitping;
 } target;
 
 target *targets;
+subtree all;		// the sums over all hosts
+
+struct {			// for the status line, updated once per round
+  unsigned int ell, qmax;	// estimated local latency, deepest reply queue
+  float rxbatch, txbatch, qdepth;
+  unsigned long filtered;
+} rstats;
+target **tlist;			// the targets in order, for the grid
+target **addrhash;		// open addressing index of targets by address
+target **bynum;			// targets by history slot, for replies from another address
+int nbynum;
+unsigned long *slotfreed;	// by history slot, when a dropped host left it; it rests as long as late replies count
+int nslotfreed;
+unsigned int addrmask;
+
+typedef struct payload {	// data carried in our echo requests, returned by the replies
+  struct timeval sent;
+  int tnum;
+  unsigned int tseq;		// UINT_MAX for train packets
+} payload;
+
+typedef struct probe {		// the main thread's record of a probe
+  timer timer;			// deadline; must be the first member
+  target *target;		// NULL when the slot is free
+  unsigned short seq;
+  int lost;			// set when the deadline passed, kept to recognise late replies
+  int round;			// ping round, and so the histlog pass, the result belongs to
+  unsigned int rto;		// the deadline it got, in microseconds
+  int train;			// 1+ its place in the host's packet train, 0 for a regular probe
+  unsigned int traingen;	// which of the host's trains it belongs to
+  unsigned int tseq;		// the host's probe number, UINT_MAX for a train packet
+  struct timespec sent;		// when it was scheduled; replies bring the exact time
+} probe;
+
+typedef struct sentprobe {	// a worker's record of a probe it sent
+  unsigned short seq;
+  int tnum;			// -1 when the slot has never been used
+  struct timespec sent;		// replaced by the kernel's TX timestamp when available
+} sentprobe;
+
+typedef struct command {	// echo request for a worker to send
+  unsigned short seq;
+  unsigned short size;		// bytes of ICMP payload, 0 for just the payload struct
+  int tnum;
+  unsigned int tseq;
+  union {
+    struct sockaddr sa;
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+  } addr;
+} command;
+
+typedef struct reply {		// echo reply, as matched and timed by a worker
+  unsigned short seq;
+  unsigned char family;
+  int tnum;			// from the payload
+  unsigned int tseq;
+  unsigned int rtt;		// microseconds
+  struct timespec sent;
+  union {
+    struct in_addr v4;
+    struct in6_addr v6;
+  } from;
+} reply;
+
+typedef struct txqueue {	// echo requests waiting for the next sendmmsg()
+  int fd, len;
+  unsigned int tskey;		// the kernel numbers the TX timestamps of each socket
+  unsigned short keyseq[MAXINFLIGHT];	// sequence number for each timestamp key
+  unsigned short seq[BATCHSIZE];
+  struct mmsghdr msgs[BATCHSIZE];
+  struct iovec iov[BATCHSIZE][2];	// the packet, and the padding of a train packet
+  struct sockaddr_storage addr[BATCHSIZE];
+  u_char packet[BATCHSIZE][ICMP_MINLEN+sizeof(payload)];
+} txqueue;
+
+typedef struct batchstats {
+  unsigned long calls;
+  unsigned long packets;
+  int max;
+} batchstats;
+
+typedef struct ring {		// single producer, single consumer
+  unsigned int head __attribute__((aligned(64)));	// only written by the consumer
+  unsigned int tail __attribute__((aligned(64)));	// only written by the producer
+  unsigned int signalled;	// tail at the last wakeup, producer only
+  unsigned int maxdepth;
+  unsigned long drops;		// records lost because the ring was full
+  unsigned long depthsum, drains;	// sampled by the consumer
+  int fd;			// eventfd, signalled by the producer
+  int recsize;
+  char *recs;			// RINGSIZE records
+} ring;
+
+typedef struct shard {		// a worker thread and the hosts it probes
+  int num;
+  unsigned short id;		// ICMP id of its echo requests
+  int sock4, sock6;
+  pthread_t thread;
+  ring cmds;			// main thread to worker
+  ring replies;			// worker to main thread
+  probe inflight[MAXINFLIGHT];	// main thread
+  unsigned short seqnext;	// main thread
+  sentprobe sent[MAXINFLIGHT];	// worker
+  txqueue txq4, txq6;		// worker
+  batchstats rxstats, txstats;	// worker
+} shard;
+
+shard *shards;
+int nshards = 1;
+
+typedef struct lookup {		// a DNS lookup for the resolver threads
+  char *host;			// forward lookups: as written in the targets file
+  int rank, detached;
+  char *comment;
+  char *train;			// "train=" option, if any
+  struct addrinfo *res;
+  int err;
+  int pending;			// main thread: the resolvers haven't reported it yet
+  struct sockaddr_storage addr;	// reverse lookups
+  char name[HOSTLEN+1];
+  struct lookup *next;		// finished reverse lookups, waiting for the main thread
+} lookup;
+
+typedef struct batch {		// lookups handed to the resolver threads together
+  lookup *jobs;
+  int n, max;
+  int reverse;
+  ring *done;			// the startup batch: per resolver thread, the jobs it finished
+  unsigned int threads;		// resolver threads started, each takes the next ring
+  unsigned int next;		// taken by the resolver threads in turn
+  unsigned int left;		// resolver threads still at it, the last one to finish reports the batch
+  struct batch *nextdone;
+} batch;
+
+lookup *lookupsdone;
+batch *batchesdone;
+batch *reloading;		// targets file being resolved for a reload
+batch *starting;		// targets file being resolved at startup, its hosts are added as their names come in
+timer mergetimer;
+histheader *oldhist;		// the history we started from, for the hosts that come in late
+size_t oldhistsize;
+int *oldindex;			// its records by address
+unsigned int oldmask;
+int lookupfd = -1, inotifyfd = -1;
+int gotreload = 0, reloadagain = 0;
+pthread_mutex_t lookuplock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct transport {	// the kind of socket the workers probe with
+  char *name;
+  char *desc;
+  int (*open)(shard *);		// opens sock4 and sock6; -1 with errno set on failure
+  int iphdr;			// IPv4 packets are read with their IP header
+  int ownid;			// we pick the ICMP ids; otherwise the kernel does and only hands us our own replies
+} transport;
+
+typedef struct snapshot {	// metrics text, shared by the connections still sending it
+  int refs;
+  int failed;			// ran out of memory while building
+  int headlen;
+  char head[160];		// HTTP response header
+  size_t len, size;
+  char *text;
+} snapshot;
+
+snapshot *metrics;
+timer metricstimer;
+
+typedef struct client {
+  timer timer;			// deadline; must be the first member
+  int fd;			// -1 when the slot is free
+  unsigned int tail;		// last bytes of the request, to find its end
+  int reqlen;
+  snapshot *snap;		// NULL until the request is in
+  size_t off;
+} client;
+
+client clients[MAXCLIENTS];
+int metricsfd = -1;
+char *metricspath;		// unix socket to remove at exit
 
 int pid;
-int sock4, sock6;
+int timerfd, epfd;
+int headless = 0;
+int timestamping = 2;		// 0 = userspace, 1 = kernel RX timestamps, 2 = kernel RX and TX timestamps
+int kernelfilter = 1;		// the sockets only pass our own echo replies
+unsigned int rtomin = RTOMIN, rtomax = TIMEOUT;	// milliseconds, see --timeout; unsigned like the RTOs in us
+int traingap = TRAINGAP;
+unsigned int traingens = 0;	// trains started by all hosts
+int interval = INTERVAL;	// seconds, see --interval
+sketch sendlate;		// how late each probe went out on its schedule, microseconds
+unsigned long sendlatesum;
+u_char padding[TRAINMAXSIZE];	// zeroes, to make train packets bigger
+unsigned long icmpbase;		// ICMP messages the host had received before we started
 int ntargets = 0, ndown = 0;
+unsigned int targetsgen = 0;	// bumped when the list of targets changes
 int pinground = 0;
 int rows, cols, gotwinch = 0;
-int msinterval, maxwidth = 0, ndetach = 0;
+int maxwidth = 0, ndetach = 0;
 int showdown = 1, showtree = 1;
-char showinfo = '\0';
-
-target *currtarget = NULL;
-
-struct timeval nexttv, tvinterval;
+int idwidth = 1;		// characters in every host id
+int firstcol = 0, lastcol = 0;	// the hosts shown in the grid, by position
+target *showinfo = NULL;
+int dirty = 0, fps = FRAMERATE;	// one bit per window in WINORDER
+unsigned long lastframe = 0;
+timer drawtimer;
+
+int logfd = -1, loglen = 0;
+unsigned char logbuf[LOGBUFSIZE];
+long long loglast;		// time of the previous record, the next one is stored relative to it
+timer logtimer;
+
+unsigned long sendepoch, nsent = 0;	// send times are derived from these to avoid drift
+timer sendtimer;
+target *nexttarget = NULL;	// the last one probed, until the next send
 
 WINDOW *header, *footer, *status, *grid, *scroller, *hostinfo, *tree, *downlist;
+char startlines[SCROLLSIZE][LINEBUF];	// the latest messages from before the scroller existed, it starts with them
+int nstartlines = 0;
 
 int open_sockets(void);
-struct timeval check_timers(void);
-int tvcmp(struct timeval, struct timeval);
-struct timeval tvsub(struct timeval, struct timeval);
-struct timeval tvadd(struct timeval, struct timeval);
-void read_socket(int);
-void print_packet(char *, int, struct sockaddr_storage *);
+int open_raw(shard *);
+int open_dgram(shard *);
+int filter_socket(int, int, unsigned short);
+unsigned long icmp_received(void);
+unsigned long kernel_filtered(void);
+unsigned long mono_ms(void);
+unsigned long mono_us(void);
+void wheel_init(wheel *, unsigned long);
+void timer_add(wheel *, timer *, unsigned long);
+void timer_del(timer *);
+void wheel_run(wheel *, unsigned long);
+unsigned long wheel_next(wheel *);
+void check_timers(void);
+void arm_timers(void);
+void send_next(timer *);
+probe *new_probe(target *);
+void probe_timeout(timer *);
+void expire_probe(probe *);
+void log_result(target *, int, unsigned int, int, struct timespec *);
+int round_pass(int);
+void update_rto(statedata *, unsigned int);
+int seq_order(target *, unsigned int);
+int track_baseline(statedata *, unsigned int);
+void ok_baseline(statedata *, unsigned int);
+void queue_probe(probe *, int, unsigned int);
+int set_train(target *, char *);
+void start_train(target *);
+void train_next(timer *);
+void train_result(target *, probe *, unsigned int);
+void finish_train(target *);
+void window_add(target *, int, int);
+void window_requeue(target *);
+void window_remove(target *, int, int);
+void deque_insert(target *, int *, int *, int *, int, unsigned int, int);
+int sketch_bucket(unsigned int);
+void sketch_add(sketch *, unsigned int);
+void sketch_remove(sketch *, unsigned int);
+void sketch_quantiles(sketch *, double *, int, unsigned int *, unsigned int, unsigned int);
+unsigned int sketch_top(int);
+unsigned int sketch_quantile(sketch *, double, unsigned int, unsigned int);
+long tsdiff(struct timespec, struct timespec);
+int start_shards(void);
+void *worker(void *);
+void read_commands(shard *);
+void read_socket(shard *, int);
+void read_errqueue(shard *, int);
+int ring_init(ring *, int);
+int ring_put(ring *, void *);
+unsigned int ring_avail(ring *);
+void ring_signal(ring *);
+void read_replies(shard *);
+void read_input(void);
+int sockaddr_equal(struct sockaddr_storage *, struct sockaddr_storage *);
+unsigned int sockaddr_hash(struct sockaddr_storage *);
+int index_targets(void);
+unsigned int fnv_hash(void *, int);
+int open_history(void);
+size_t history_size(unsigned int);
+void init_state(statedata *, target *);
+int open_log(char *);
+void log_varint(unsigned long long);
+void log_string(char *);
+void log_target(target *);
+void log_probe(target *, struct timespec *, unsigned int, int);
+void flush_log(timer *);
+int get_varint(unsigned char **, unsigned char *, unsigned long long *);
+char *logtime(long long);
+int analyze_log(char *);
+target *find_target(struct sockaddr_storage *);
+int parse_packet(shard *, char *, int, struct sockaddr_storage *, reply *);
+void print_packet(shard *, reply *);
 char *print_type(int);
 int read_targets(void);
-void send_ping(target *);
+batch *parse_targets(void);
+int merge_targets(batch *);
+int list_target(target *, lookup *, int, int, int, target **);
+void add_slot(target *);
+void carry_state(target *);
+void drop_oldhist(void);
+void drop_target(target *);
+int grow_history(unsigned int);
+void reload_targets(void);
+void sig_reload(int);
+void read_inotify(void);
+void report(char *, ...);
+void announce(char *, ...);
+int run_lookups(batch *);
+void *resolver(void *);
+void add_lookup(batch *, target *);
+void free_batch(batch *);
+int start_lookups(void);
+void read_lookups(void);
+void merge_resolved(timer *);
+int open_metrics(char *);
+char *metric_labels(target *);
+snapshot *new_snapshot(size_t);
+void metric_printf(snapshot *, char *, ...);
+void metric_append(snapshot *, snapshot *);
+int metric_value(target *, logdata *, int, double *);
+void start_parts(void);
+void add_metrics(target *);
+void build_metrics(timer *);
+void drop_snapshot(snapshot *);
+void accept_client(void);
+void serve_client(int, int);
+void send_metrics(client *);
+void client_timeout(timer *);
+void close_client(client *);
+void send_ping(shard *, command *);
+void flush_queue(shard *, txqueue *);
+void flush_sends(void);
+void count_batch(batchstats *, int);
+void total_batch(batchstats *, batchstats *);
 u_short calc_checksum(struct icmp *, int);
 void start_curses(void);
 void draw_border(WINDOW *, char *);
 void print_scroll(char *, ...);
 void print_status(char *, ...);
+void print_round(void);
+void layout_tree(void);
+void aggregate(target *);
+void rebuild_aggregates(void);
+target *down_above(target *);
 void print_tree(void);
+void print_ids(void);
+void print_grid(void);
+void page_grid(int);
+int fit_columns(int, int);
+void make_id(char *, int);
+void redraw_targets(void);
+void print_treehost(target *);
 void print_info(void);
 void print_down(void);
 void update_screen(int);
-logdata *get_logdata(int);
+void draw_screen(timer *);
+logdata *get_logdata(target *);
 char *itoa(int);
 char *itodur(int);
+char *ustoms(unsigned int);
 void sig_winch(int);
 void got_winch(void);
 WINDOW *resize_win(WINDOW *, int, int, int, int, int);
 void do_exit(int sig);
 
+transport transports[] = {	// the first one is the default, and the fallback
+  { "raw", "raw ICMP sockets", open_raw, 1, 1 },
+  { "dgram", "ICMP datagram sockets", open_dgram, 0, 0 }
+};
+transport *tport = transports;
+
 int main(int argc, char *argv[]) {
-  int c, r;
-  char *cp, *idp = IDSEQUENCE;
-  target *tp;
-  fd_set fdmask;
-  struct timeval timeout;
+  int c, r, s;
+  char *metricsarg = NULL;
+  struct epoll_event ev, events[MAXEVENTS];
+  static struct option longopts[] = {
+    { "analyze", required_argument, NULL, 'a' },
+    { "headless", no_argument, NULL, 'h' },
+    { "metrics", required_argument, NULL, 'm' },
+    { "fps", required_argument, NULL, 'f' },
+    { "shards", required_argument, NULL, 's' },
+    { "socket", required_argument, NULL, 'k' },
+    { "timeout", required_argument, NULL, 't' },
+    { "traingap", required_argument, NULL, 'g' },
+    { "interval", required_argument, NULL, 'i' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+    switch (c) {
+      case 'a': setuid(getuid());
+                exit(analyze_log(optarg));
+      case 'h': headless = 1;
+                break;
+      case 'm': metricsarg = optarg;
+                break;
+      case 'f': if ((fps = atoi(optarg)) < 1) fps = 1;
+                if (fps > 1000) fps = 1000;
+                break;
+      case 's': if ((nshards = atoi(optarg)) < 1) nshards = 1;
+                if (nshards > MAXSHARDS) nshards = MAXSHARDS;
+                break;
+      case 'k': for (tport = transports; tport < transports+sizeof(transports)/sizeof(transport); tport++) {
+                  if (!strcmp(optarg, tport->name)) break;
+                }
+                if (tport < transports+sizeof(transports)/sizeof(transport)) break;
+                fprintf(stderr, "Unknown socket type %s, use raw or dgram\n", optarg);
+                exit(-2);
+      case 't': if ((sscanf(optarg, "%u,%u", &rtomin, &rtomax) == 2) && (rtomin > 0) && (rtomax >= rtomin) && (rtomax <= UINT_MAX/2000)) break;	// twice rtomax in us has to fit
+                fprintf(stderr, "Use --timeout min,max in milliseconds\n");
+                exit(-2);
+      case 'g': if ((traingap = atoi(optarg)) < 0) traingap = 0;
+                break;
+      case 'i': if ((interval = atoi(optarg)) < 1) interval = 1;
+                break;
+      default:  fprintf(stderr, "Usage: %s [--headless] [--metrics port|socket] [--fps n] [--shards n] [--socket raw|dgram] [--timeout min,max] [--traingap ms] [--interval s] [logfile]\n       %s --analyze logfile\n", argv[0], argv[0]);
+                exit(-2);
+    }
+  }
+
+  pid = getpid();
 
   if (open_sockets() == -1) exit(-1);
 
@@ -149,536 +682,3118 @@ int main(int argc, char *argv[]) {
 
   prctl(PR_SET_DUMPABLE, 1); // debug
 
-  pid = getpid();
-
-  signal(SIGHUP, do_exit);
+  signal(SIGHUP, sig_reload);
   signal(SIGINT, do_exit);
   signal(SIGTERM, do_exit);
 //  signal(SIGWINCH, sig_winch); // while debugging
 
-  if (read_targets() == -1) exit(-3);
+  if (start_lookups() == -1) exit(-7);
+  if (read_targets() == -1) exit(-3);	// with the names that are still coming in left out
+  if (index_targets() == -1) exit(-3);
 
-  histlog = (passdata *)malloc(sizeof(passdata)*HISTLOG);
-  if (!histlog) {
-    printf("Error allocating memory for history log; system out of memory?\n");
-    exit(-4);
+  if (open_history() == -1) exit(-4);
+  if ((optind < argc) && (open_log(argv[optind]) == -1)) exit(-5);
+  if (metricsarg && (open_metrics(metricsarg) == -1)) exit(-8);
+
+  if ((timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1) {
+    perror("timerfd_create()");
+    exit(-6);
   }
-  memset(histlog, 0, sizeof(passdata)*HISTLOG);
-  for (c = 0; c < HISTLOG; c++) {
-    histlog[c].data = (pingdata *)malloc(sizeof(pingdata)*ntargets);
-    if (!histlog[c].data) {
-      printf("Error allocating memory for histlog; system out of memory?\n");
-      exit(-5);
-    }
-    memset(histlog[c].data, 0, sizeof(pingdata)*ntargets);
+  if ((epfd = epoll_create1(0)) == -1) {
+    perror("epoll_create1()");
+    exit(-6);
+  }
+  ev.events = EPOLLIN;
+  ev.data.fd = 0;
+  if (!headless) epoll_ctl(epfd, EPOLL_CTL_ADD, 0, &ev);
+  ev.data.fd = timerfd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev);
+  if (metricsfd != -1) {
+    ev.data.fd = metricsfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, metricsfd, &ev);
+  }
+  ev.data.fd = lookupfd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, lookupfd, &ev);
+  if ((inotifyfd = inotify_init1(IN_NONBLOCK)) != -1) {	// without it there's still SIGHUP
+    if (inotify_add_watch(inotifyfd, ".", IN_CLOSE_WRITE|IN_MOVED_TO) == -1) perror("inotify_add_watch()");
+    ev.data.fd = inotifyfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, inotifyfd, &ev);
   }
-  printf("Data storage for history log initialised (%d bytes)\n", sizeof(passdata)*HISTLOG*sizeof(pingdata)*ntargets);
-
-  memset(&nexttv, 0, sizeof(struct timeval));
-  msinterval = INTERVAL*1000/ntargets;
-  tvinterval.tv_sec = INTERVAL/ntargets;
-  tvinterval.tv_usec = INTERVAL*1000000/ntargets%1000000;
 
-  printf("Ping timeout is %d milliseconds\n", msinterval);
-  printf("Ping throughput is %d pings per minute\n", INTERVAL/60*ntargets);
-  printf("Initialisation complete, starting in %d", INITWAIT?INITWAIT:1);
+  announce("Ping timeout adapts to each host, between %u and %u milliseconds", rtomin, rtomax);
+  announce("Using %s", tport->desc);
+  announce("Using %s timestamps", timestamping?timestamping==2?"kernel RX and TX":"kernel RX":"userspace");
+  announce("%s foreign ICMP in the kernel", kernelfilter?"Filtering":"Not filtering");
+  announce("Ping throughput is %d pings per minute", ntargets*60/interval);
+  if (nshards > 1) announce("Probing with %d worker threads", nshards);
+  announce("Initialisation complete%s", headless?", running headless":"");
   fflush(stdout);
-  sleep(1);
-  for (c = INITWAIT-1; c; c--) {
-    printf("\b%d", c);
-    fflush(stdout);
-    sleep(1);
+
+  wheel_init(&timers, mono_ms());
+  drawtimer.func = draw_screen;
+  mergetimer.func = merge_resolved;
+  if (!headless) start_curses();
+  sendepoch = timers.now;
+  sendtimer.func = send_next;
+  timer_add(&timers, &sendtimer, sendepoch);
+  if (logfd != -1) {
+    logtimer.func = flush_log;
+    timer_add(&timers, &logtimer, sendepoch+LOGFLUSH);
+  }
+  if (metricsfd != -1) {
+    metricstimer.func = build_metrics;
+    metricstimer.expires = sendepoch;
+    build_metrics(&metricstimer);	// also arms it
   }
-  printf("\b0\n");
 
-  start_curses();
+  if (start_shards() == -1) exit(-6);
 
   while (1) {
     if (gotwinch) got_winch();
+    if (gotreload) reload_targets();
 
-    FD_ZERO(&fdmask);
-    FD_SET(0, &fdmask);
-    FD_SET(sock4, &fdmask);
-    FD_SET(sock6, &fdmask);
-
-    timeout = check_timers();
+    flush_sends();
+    arm_timers();
 
-    r = select(sock6+1, &fdmask, 0, 0, &timeout);
+    r = epoll_wait(epfd, events, MAXEVENTS, -1);
     if (r == -1) {
       if (errno == EINTR) continue;
-      perror("select()");
+      perror("epoll_wait()");
       abort();	// debug
     }
-    if (FD_ISSET(sock4, &fdmask)) read_socket(sock4);
-    if (FD_ISSET(sock6, &fdmask)) read_socket(sock6);
-    if (FD_ISSET(0, &fdmask)) {
-      if ((r = getc(stdin)) == EOF) {
-        perror("getc(stdin)");
-        exit(-7);
-      }
-      r = toupper(r);
-      if (r == '\r') {
-        if (showdown && ndown) showdown = 0;
-        else if (showdown == 2) showdown = 1;
-        else if (ndown) {
-          showdown = 1;
-          print_down();
+    for (c = 0; c < r; c++) {
+      if (events[c].data.fd == timerfd) check_timers();
+      else if (events[c].data.fd == metricsfd) accept_client();
+      else if (events[c].data.fd == 0) read_input();
+      else if (events[c].data.fd == lookupfd) read_lookups();
+      else if (events[c].data.fd == inotifyfd) read_inotify();
+      else {
+        for (s = 0; s < nshards; s++) {
+          if (events[c].data.fd == shards[s].replies.fd) break;
         }
-        else showdown = 2;
+        if (s < nshards) read_replies(&shards[s]);
+        else serve_client(events[c].data.fd, events[c].events);
       }
-      else if (r == ' ') {
-        if (showtree) {
-          showtree = 0;
-          mvwin(downlist, 1, cols-40);
-        }
-        else {
-          showtree = 1;
-          mvwin(downlist, 1, cols-40-(maxwidth+5));
-        }
+    }
+  }
+}
+
+int open_sockets(void) {
+  int c, one = 1, tsflags = SOF_TIMESTAMPING_TX_SOFTWARE|SOF_TIMESTAMPING_RX_SOFTWARE|SOF_TIMESTAMPING_SOFTWARE
+                         |SOF_TIMESTAMPING_OPT_ID|SOF_TIMESTAMPING_OPT_TSONLY;
+  shard *sh;
+
+  if (!(shards = (shard *)calloc(nshards, sizeof(shard)))) {
+    perror("calloc()");
+    return -1;
+  }
+  for (c = 0; c < nshards; c++) {
+    sh = &shards[c];
+    sh->num = c;
+    sh->id = pid+c;
+    if (tport->open(sh) == -1) {
+      if (c || (tport == transports)) {
+        perror("socket()");
+        return -1;
+      }
+      fprintf(stderr, "Can't open %s (%s), falling back to %s\n", tport->desc, strerror(errno), transports[0].desc);
+      tport = transports;
+      if (tport->open(sh) == -1) {
+        perror("socket()");
+        return -1;
       }
-      else if (r == showinfo) showinfo = '\0';
-      else if (((cp = strchr(idp, r))) && (cp-idp < ntargets)) {
-        showinfo = r;
-        print_info();
+    }
+    sh->txq4.fd = sh->sock4;
+    sh->txq6.fd = sh->sock6;
+
+    if (timestamping == 2) {
+      if ((setsockopt(sh->sock4, SOL_SOCKET, SO_TIMESTAMPING, &tsflags, sizeof(tsflags)) == -1)
+       || (setsockopt(sh->sock6, SOL_SOCKET, SO_TIMESTAMPING, &tsflags, sizeof(tsflags)) == -1)) {
+        tsflags = 0;
+        setsockopt(sh->sock4, SOL_SOCKET, SO_TIMESTAMPING, &tsflags, sizeof(tsflags));
+        setsockopt(sh->sock6, SOL_SOCKET, SO_TIMESTAMPING, &tsflags, sizeof(tsflags));
+        if (c) {	// it worked for the first shard
+          perror("setsockopt(SO_TIMESTAMPING)");
+          return -1;
+        }
+        timestamping = 1;
       }
-      else if ((r == '!') && showinfo) {
-        for (tp = targets; tp; tp = tp->next) {
-          if (tp->id == showinfo) break;
+    }
+    if (timestamping == 1) {
+      if ((setsockopt(sh->sock4, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) == -1)
+       || (setsockopt(sh->sock6, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) == -1)) {
+        if (c) {
+          perror("setsockopt(SO_TIMESTAMPNS)");
+          return -1;
         }
-        if (tp->beepmode++ == 2) tp->beepmode = 0;
-        print_info();
+        timestamping = 0;
+      }
+    }
+
+    if (tport->ownid && kernelfilter && ((filter_socket(sh->sock4, AF_INET, sh->id) == -1) || (filter_socket(sh->sock6, AF_INET6, sh->id) == -1))) {
+      if (c) {
+        perror("setsockopt(SO_ATTACH_FILTER)");
+        return -1;
       }
-      update_screen('f');
+      kernelfilter = 0;	// parse_packet() still checks everything
     }
   }
+  if (!tport->ownid) kernelfilter = 0;	// the kernel demultiplexes ping sockets, there's no filter of ours
+  icmpbase = icmp_received();
+  return 0;
 }
 
-int open_sockets(void) {
-  if ((sock4 = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP)) < 0) {
-    perror("socket()");
+int open_raw(shard *sh) {
+  if ((sh->sock4 = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP)) < 0) return -1;
+  if ((sh->sock6 = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6)) < 0) return -1;
+  return 0;
+}
+
+int open_dgram(shard *sh) {	// needs the gid in net.ipv4.ping_group_range, but no privileges
+  int err;
+
+  if ((sh->sock4 = socket(AF_INET, SOCK_DGRAM, IPPROTO_ICMP)) < 0) return -1;
+  if ((sh->sock6 = socket(AF_INET6, SOCK_DGRAM, IPPROTO_ICMPV6)) < 0) {
+    err = errno;
+    close(sh->sock4);
+    errno = err;
     return -1;
   }
-  if ((sock6 = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6)) < 0) {
-    perror("socket()");
-    return -1;
+  return 0;	// the kernel gives each socket its own id and checksums the echo requests
+}
+
+int filter_socket(int sock, int family, unsigned short id) {	// lets only our own echo replies through, see kernel_filtered() for the rest
+  struct icmp6_filter filt6;
+  struct sock_filter code4[] = {
+    BPF_STMT(BPF_LDX|BPF_B|BPF_MSH, 0),		// X = length of the IP header
+    BPF_STMT(BPF_LD|BPF_B|BPF_IND, 0),		// ICMP type
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ICMP_ECHOREPLY, 0, 3),
+    BPF_STMT(BPF_LD|BPF_H|BPF_IND, 4),		// ICMP id
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, id, 0, 1),
+    BPF_STMT(BPF_RET|BPF_K, 0xffff),
+    BPF_STMT(BPF_RET|BPF_K, 0)
+  };
+  struct sock_filter code6[] = {		// IPv6 raw sockets start at the ICMP header
+    BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 0),
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ICMP6_ECHO_REPLY, 0, 3),
+    BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 4),
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, id, 0, 1),
+    BPF_STMT(BPF_RET|BPF_K, 0xffff),
+    BPF_STMT(BPF_RET|BPF_K, 0)
+  };
+  struct sock_fprog prog;
+
+  if (family == AF_INET) {
+    prog.len = sizeof(code4)/sizeof(struct sock_filter);
+    prog.filter = code4;
   }
-  return 0;
+  else {
+    ICMP6_FILTER_SETBLOCKALL(&filt6);	// cheaper than BPF, but can't look at the id
+    ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filt6);
+    if (setsockopt(sock, IPPROTO_ICMPV6, ICMP6_FILTER, &filt6, sizeof(filt6)) == -1) return -1;
+    prog.len = sizeof(code6)/sizeof(struct sock_filter);
+    prog.filter = code6;
+  }
+  return setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
 }
 
-struct timeval check_timers(void) {
-  int ellsum = 0;
-  static int ell = 0, currid = 0;
-  char timebuf[10];
-  target *tp;
-  time_t now;
-  struct tm *currtm;
-  struct timeval currtv, temptv;
+unsigned long icmp_received(void) {	// ICMP and ICMPv6 messages received by the host
+  int c;
+  unsigned long v4 = 0, v6 = 0;
+  char line[LINEBUF];
+  FILE *fp;
+
+  if ((fp = fopen("/proc/net/snmp", "r"))) {
+    for (c = 0; fgets(line, LINEBUF, fp); ) {
+      if (strncmp(line, "Icmp: ", 6)) continue;
+      if (c++) {	// the first line has the field names; InMsgs comes first
+        v4 = strtoul(line+6, NULL, 10);
+        break;
+      }
+    }
+    fclose(fp);
+  }
+  if ((fp = fopen("/proc/net/snmp6", "r"))) {
+    while (fgets(line, LINEBUF, fp)) {
+      if (strncmp(line, "Icmp6InMsgs", 11)) continue;
+      v6 = strtoul(line+11, NULL, 10);
+      break;
+    }
+    fclose(fp);
+  }
+  return v4+v6;
+}
 
-  gettimeofday(&currtv, NULL);
+unsigned long kernel_filtered(void) {	// an estimate: the host's ICMP also counts other processes' packets
+  long n;
+  batchstats rx, tx;
 
-  if (tvcmp(currtv, nexttv) < 0) return tvsub(nexttv, currtv);
+  if (!kernelfilter) return 0;
+  total_batch(&rx, &tx);
+  n = (long)(icmp_received()-icmpbase)*nshards - rx.packets;	// every shard has a socket for either family
+  return n < 0?0:n;
+}
 
-  now = time(NULL);
-  currtm = localtime(&now);
-
-  if (currtarget) {
-    if (currtarget->waitping) {
-      waddch(grid, '\b');
-      waddch(grid, GRIDMARK|COLOR_PAIR(STATE_LOSS));
-      wattron(scroller, COLOR_PAIR(STATE_LOSS));
-      print_scroll("%c  %-40.40s %-40s >%4d ms  (timeout)", currtarget->id, currtarget->name, currtarget->ipstr,
-        msinterval);
-      currtarget->losscount++;
-      if (!currtarget->beepmode) beep();
-      if (!currtarget->downsince) currtarget->downsince = now;
-      if ((currtarget->lastcolor == STATE_LOSS) && (currtarget->treecolor != STATE_LOSS)) {
-        currtarget->treecolor = STATE_LOSS;
-        print_tree();
-        ndown++;
-        if (showdown) print_down();
+unsigned long mono_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000UL + ts.tv_nsec/1000000;
+}
+
+unsigned long mono_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000UL + ts.tv_nsec/1000;
+}
+
+void wheel_init(wheel *w, unsigned long now) {	// hierarchical timing wheel: adding, deleting and expiring a timer are O(1)
+  int l, c;
+
+  w->now = now;
+  for (l = 0; l < WHEELLEVELS; l++) {
+    for (c = 0; c < 1<<WHEELBITS; c++) w->slot[l][c].next = w->slot[l][c].prev = &w->slot[l][c];
+  }
+}
+
+void timer_add(wheel *w, timer *tm, unsigned long expires) {
+  int level;
+  unsigned long at = expires;
+  timer *head;
+
+  if (tm->next) timer_del(tm);
+  tm->expires = expires;
+  if (at < w->now) at = w->now;	// overdue timers run on the next tick
+  for (level = 0; level < WHEELLEVELS-1; level++) {
+    if (at-w->now < 1UL<<(WHEELBITS*(level+1))) break;
+  }
+  if (at-w->now >= 1UL<<(WHEELBITS*WHEELLEVELS)) at = w->now+(1UL<<(WHEELBITS*WHEELLEVELS))-1;	// gets cascaded again
+  head = &w->slot[level][(at>>(WHEELBITS*level))&((1<<WHEELBITS)-1)];
+  tm->next = head;
+  tm->prev = head->prev;
+  head->prev->next = tm;
+  head->prev = tm;
+}
+
+void timer_del(timer *tm) {
+  if (!tm->next) return;
+  tm->prev->next = tm->next;
+  tm->next->prev = tm->prev;
+  tm->next = tm->prev = NULL;
+}
+
+void wheel_run(wheel *w, unsigned long now) {
+  int level;
+  timer *head, list, *tm;
+
+  for (; w->now <= now; w->now++) {
+    for (level = 1; level < WHEELLEVELS; level++) {	// cascade every slot we've just moved into
+      if (w->now & ((1UL<<(WHEELBITS*level))-1)) break;
+      head = &w->slot[level][(w->now>>(WHEELBITS*level))&((1<<WHEELBITS)-1)];
+      if (head->next == head) continue;
+      list.next = head->next;
+      list.prev = head->prev;
+      list.next->prev = list.prev->next = &list;
+      head->next = head->prev = head;
+      while (list.next != &list) {
+        tm = list.next;
+        timer_del(tm);
+        timer_add(w, tm, tm->expires);
+      }
+    }
+    head = &w->slot[0][w->now&((1<<WHEELBITS)-1)];
+    while (head->next != head) {
+      tm = head->next;
+      timer_del(tm);
+      tm->func(tm);
+    }
+  }
+}
+
+unsigned long wheel_next(wheel *w) {	// returns the first tick that needs processing, ULONG_MAX if none
+  int level, k;
+  unsigned long base, next = ULONG_MAX;
+
+  for (k = 0; k < 1<<WHEELBITS; k++) {
+    if (w->slot[0][(w->now+k)&((1<<WHEELBITS)-1)].next != &w->slot[0][(w->now+k)&((1<<WHEELBITS)-1)]) {
+      next = w->now+k;
+      break;
+    }
+  }
+  for (level = 1; level < WHEELLEVELS; level++) {
+    base = w->now>>(WHEELBITS*level);
+    for (k = (w->now&((1UL<<(WHEELBITS*level))-1))?1:0; k <= 1<<WHEELBITS; k++) {
+      if (w->slot[level][(base+k)&((1<<WHEELBITS)-1)].next != &w->slot[level][(base+k)&((1<<WHEELBITS)-1)]) {
+        if ((base+k)<<(WHEELBITS*level) < next) next = (base+k)<<(WHEELBITS*level);
+        break;
       }
-      histlog[currlog].data[currtarget->num].rtt = -1;
-      histlog[currlog].data[currtarget->num].color = STATE_LOSS;
-      currtarget->lastcolor = STATE_LOSS;
-      if (currtarget->id == showinfo) print_info();
     }
-    currtarget = currtarget->next;
   }
-  if (!currtarget) {
-    currtarget = targets;
+  return next;
+}
+
+void check_timers(void) {
+  unsigned long long expirations;
+
+  if (read(timerfd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) perror("read(timerfd)");
+  wheel_run(&timers, mono_ms());
+}
+
+void arm_timers(void) {
+  static unsigned long armed = 0;
+  unsigned long next;
+  struct itimerspec its;
+
+  next = wheel_next(&timers);
+  if (next == armed) return;
+  memset(&its, 0, sizeof(its));
+  if (next != ULONG_MAX) {
+    its.it_value.tv_sec = next/1000;
+    its.it_value.tv_nsec = next%1000*1000000;
+  }
+  if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) perror("timerfd_settime()");
+  armed = next;
+}
+
+void send_next(timer *tm) {
+  int c;
+  static unsigned long lastdrains = 0, lastdepthsum = 0;
+  static batchstats rxlast, txlast;
+  unsigned long drains, depthsum, late;
+  batchstats rx, tx;
+  target *tp;
+  probe *pp;
+  time_t now;
+
+  now = time(NULL);
+  late = mono_us();
+  late = (late > tm->expires*1000?late-tm->expires*1000:0);	// the timers only have ms resolution
+  sketch_add(&sendlate, late);
+  sendlatesum += late;
+
+  if (nexttarget) nexttarget = nexttarget->next;
+  if (!nexttarget) {
+    nexttarget = targets;
     pinground++;
-    snprintf(timebuf, 9, "\n[%02d:%02d] ", currtm->tm_hour, currtm->tm_min);
-    waddstr(grid, timebuf);
-    if (showdown && ndown) print_down();
-    if (pinground > 1) {
-      for (tp = targets; tp; tp = tp->next) ellsum += tp->rttlast - tp->rttmin;
-      ell = ellsum / ntargets;
+    if (showdown && ndown) update_screen('d');
+    if ((pinground > 1) && all.replied) rstats.ell = all.excess / all.replied;
+    total_batch(&rx, &tx);
+    if (rx.calls > rxlast.calls) rstats.rxbatch = (float)(rx.packets-rxlast.packets)/(rx.calls-rxlast.calls);
+    if (tx.calls > txlast.calls) rstats.txbatch = (float)(tx.packets-txlast.packets)/(tx.calls-txlast.calls);
+    rxlast = rx;
+    txlast = tx;
+    for (c = 0, drains = depthsum = 0, rstats.qmax = 0; c < nshards; c++) {
+      drains += shards[c].replies.drains;
+      depthsum += shards[c].replies.depthsum;
+      if (__atomic_load_n(&shards[c].replies.maxdepth, __ATOMIC_RELAXED) > rstats.qmax) rstats.qmax = __atomic_load_n(&shards[c].replies.maxdepth, __ATOMIC_RELAXED);
     }
+    if (drains > lastdrains) rstats.qdepth = (float)(depthsum-lastdepthsum)/(drains-lastdrains);
+    lastdrains = drains;
+    lastdepthsum = depthsum;
+    rstats.filtered = kernel_filtered();
+    update_screen('a');
     if (++currlog == HISTLOG) currlog = 0;
-    histlog[currlog].time = now;
+    for (tp = targets; tp; tp = tp->next) {	// the oldest pass leaves the window
+      if (histlog[currlog].data[tp->num].color) window_remove(tp, currlog, pinground-HISTLOG);
+    }
+    memset(histlog[currlog].data, 0, sizeof(pingdata)*hist->ntargets);
+    hist->passtime[currlog] = now;
+    hist->currlog = currlog;
+    hist->pinground = pinground;
+    msync(hist, histsize, MS_ASYNC);
+  }
+
+  pp = new_probe(nexttarget);
+  pp->tseq = nexttarget->tseq++;
+  nexttarget->seqwin <<= 1;
+  nexttarget->st->probecount++;
+  nexttarget->lastround = pinground;
+  update_screen('g');
+
+  if (!nexttarget->st->rto) nexttarget->st->rto = rtomax*1000;	// nothing learned yet
+  queue_probe(pp, 0, nexttarget->st->rto);
+  if (nexttarget->train) start_train(nexttarget);
+
+  nsent++;
+  timer_add(&timers, tm, sendepoch+nsent*interval*1000/ntargets);
+}
+
+probe *new_probe(target *tp) {
+  probe *pp;
+  shard *sh = &shards[tp->num%nshards];
+
+  pp = &sh->inflight[sh->seqnext%MAXINFLIGHT];
+  if (pp->target && !pp->lost) expire_probe(pp);	// Table full; the oldest probe has to give way
+  memset(pp, 0, sizeof(probe));
+  pp->timer.func = probe_timeout;
+  pp->target = tp;
+  pp->seq = sh->seqnext++;
+  pp->round = pinground;
+  return pp;
+}
+
+void queue_probe(probe *pp, int size, unsigned int rto) {	// hands it to the worker of its host
+  command cm;
+  target *tp = pp->target;
+
+  clock_gettime(CLOCK_REALTIME, &pp->sent);
+  cm.seq = pp->seq;
+  cm.size = size;
+  cm.tnum = tp->num;
+  cm.tseq = pp->tseq;
+  memcpy(&cm.addr, tp->addr, sizeof(cm.addr));
+  ring_put(&shards[tp->num%nshards].cmds, &cm);	// if that fails, the probe times out
+  pp->rto = rto;
+  timer_add(&timers, &pp->timer, mono_ms()+(rto+999)/1000);
+}
+
+void probe_timeout(timer *tm) {
+  expire_probe((probe *)tm);
+}
+
+void expire_probe(probe *pp) {
+  target *tp = pp->target;
+  target *up;
+
+  timer_del(&pp->timer);
+  pp->lost = 1;
+  if (pp->train) {
+    train_result(tp, pp, UINT_MAX);
+    return;
+  }
+  up = down_above(tp);
+  wattron(scroller, COLOR_PAIR(STATE_LOSS));
+  if (up) print_scroll("%s  %-40.40s %-40s >%6s ms  (timeout, behind %s)", tp->id, tp->name, tp->ipstr, ustoms(pp->rto), up->id);
+  else print_scroll("%s  %-40.40s %-40s >%6s ms  (timeout)", tp->id, tp->name, tp->ipstr, ustoms(pp->rto));
+  tp->st->losscount++;
+  tp->st->rto = (2*tp->st->rto < rtomax*1000?2*tp->st->rto:rtomax*1000);	// back off until it replies again
+  if (!tp->st->beepmode && !headless && !up) beep();	// its parent being down says it all
+  if (!tp->st->downsince) tp->st->downsince = time(NULL);
+  if ((tp->st->lastcolor == STATE_LOSS) && (tp->st->treecolor != STATE_LOSS)) {
+    tp->st->treecolor = STATE_LOSS;
+    print_treehost(tp);
+    ndown++;
+    if (showdown) update_screen('d');
+  }
+  log_result(tp, pp->round, -1, STATE_LOSS, &pp->sent);
+  tp->st->lastcolor = STATE_LOSS;
+  aggregate(tp);
+  if (tp == showinfo) update_screen('i');
+}
+
+int set_train(target *tp, char *spec) {	// spec is "train=<len>[:<size>[,<size>...]]", echoes after the regular probe
+  int len, nsizes = 0;
+  unsigned short sizes[TRAINSIZES];
+  long size;
+  char *cp = NULL;
+
+  if (spec) {
+    len = strtol(spec+6, &cp, 10);
+    if (*cp == ':') {
+      do {
+        size = strtol(cp+1, &cp, 10);
+        if ((size < sizeof(payload)) || (size > TRAINMAXSIZE)) break;
+        sizes[nsizes++] = size;
+      } while ((*cp == ',') && (nsizes < TRAINSIZES));
+    }
+    else sizes[nsizes++] = sizeof(payload);
+    if ((len < 2) || (len > MAXTRAIN) || *cp || !nsizes) {
+      report("- %s: ignoring %s, use train=<2-%d>[:<%d-%d bytes>,...]", tp->ipstr, spec, MAXTRAIN, (int)sizeof(payload), TRAINMAXSIZE);
+      spec = NULL;
+    }
+  }
+  if (!spec) {
+    if (tp->train) timer_del(&tp->train->timer);
+    free(tp->train);
+    tp->train = NULL;
+    return 0;
+  }
+  if (tp->train && (tp->train->len == len) && (tp->train->nsizes == nsizes)
+   && !memcmp(tp->train->sizes, sizes, sizeof(unsigned short)*nsizes)) return 0;	// unchanged by a reload
+
+  if (tp->train) timer_del(&tp->train->timer);
+  else if (!(tp->train = (train *)malloc(sizeof(train)))) {
+    perror("malloc()");
+    return -1;
+  }
+  memset(tp->train, 0, sizeof(train));
+  tp->train->target = tp;
+  tp->train->timer.func = train_next;
+  tp->train->len = len;
+  tp->train->nsizes = nsizes;
+  memcpy(tp->train->sizes, sizes, sizeof(unsigned short)*nsizes);
+  return 0;
+}
+
+void start_train(target *tp) {
+  int c;
+  train *tr = tp->train;
+
+  if (tr->left) finish_train(tp);	// the previous one never completed
+  for (c = 0; c < tr->len; c++) tr->rtt[c] = UINT_MAX;
+  tr->next = tr->done = 0;
+  tr->left = tr->len;
+  tr->gen = ++traingens;
+  train_next(&tr->timer);
+}
+
+void train_next(timer *tm) {	// also the callback of the train's timer
+  train *tr = (train *)tm;
+  probe *pp;
+
+  do {
+    pp = new_probe(tr->target);
+    pp->train = tr->next+1;
+    pp->traingen = tr->gen;
+    pp->tseq = UINT_MAX;
+    queue_probe(pp, tr->sizes[tr->next%tr->nsizes], rtomax*1000);	// a train has the same deadline for all sizes
+  } while ((++tr->next < tr->len) && !traingap);
+  if (tr->next < tr->len) timer_add(&timers, tm, mono_ms()+traingap);
+}
+
+void train_result(target *tp, probe *pp, unsigned int rtt) {	// rtt is UINT_MAX for a lost packet
+  train *tr = tp->train;
+  int idx = pp->train-1;
+
+  if (!tr || !tr->left || (pp->traingen != tr->gen) || (idx >= tr->len) || (tr->done & 1U<<idx)) return;	// from an earlier train
+  tr->rtt[idx] = rtt;
+  tr->done |= 1U<<idx;
+  if (!--tr->left) finish_train(tp);
+}
+
+void finish_train(target *tp) {
+  int c, s, n, prev[TRAINSIZES];
+  unsigned int d;
+  char buf[TRAINSIZES*20+1] = "";
+  train *tr = tp->train;
+
+  for (s = 0; s < tr->nsizes; s++) prev[s] = -1;
+  for (c = 0, tr->lastlost = 0; c < tr->next; c++) {	// cut short by the next train, if not all were sent
+    if (tr->rtt[c] == UINT_MAX) {
+      tr->lastlost++;
+      continue;
+    }
+    s = c%tr->nsizes;
+    tr->sizertt[s] = (tr->sizertt[s]?(7*(unsigned long)tr->sizertt[s]+tr->rtt[c])/8:tr->rtt[c]);
+    if (prev[s] != -1) {	// jitter between packets of the same size, so it isn't the size that shows
+      d = (tr->rtt[c] > tr->rtt[prev[s]]?tr->rtt[c]-tr->rtt[prev[s]]:tr->rtt[prev[s]]-tr->rtt[c]);
+      tr->jitter += (d-tr->jitter)/16;
+    }
+    prev[s] = c;
+  }
+  tr->trains++;
+  tr->packets += tr->next;
+  tr->lost += tr->lastlost;
+  tr->left = 0;
+  timer_del(&tr->timer);
+
+  for (s = 0, n = 0; (s < tr->nsizes) && (tr->nsizes > 1); s++) {
+    n += snprintf(&buf[n], sizeof(buf)-n, " %ub %s", tr->sizes[s], tr->sizertt[s]?ustoms(tr->sizertt[s]):"-");
+  }
+  wattron(scroller, COLOR_PAIR(tr->lastlost?STATE_LOSS:STATE_OK));
+  print_scroll("%s  %-40.40s %-40s train %d/%d  jitter %s ms%s", tp->id, tp->name, tp->ipstr, tr->next-tr->lastlost, tr->next, ustoms(tr->jitter), buf);
+  if (tp == showinfo) update_screen('i');
+}
+
+void update_rto(statedata *sd, unsigned int r) {	// like TCP: smoothed RTT plus four times its deviation, within --timeout
+  unsigned int rto;
+
+  if (!sd->srtt) {	// the first sample
+    sd->srtt = r;
+    sd->rttvar = r/2;
+  }
+  else {
+    sd->rttvar = (3*(unsigned long)sd->rttvar + (r > sd->srtt?r-sd->srtt:sd->srtt-r))/4;
+    sd->srtt = (7*(unsigned long)sd->srtt + r)/8;
+  }
+  rto = sd->srtt + (4*sd->rttvar > RTOGRAIN?4*sd->rttvar:RTOGRAIN);
+  if (rto < rtomin*1000) rto = rtomin*1000;
+  if (rto > rtomax*1000) rto = rtomax*1000;
+  sd->rto = rto;
+}
+
+void log_result(target *tp, int round, unsigned int rtt, int color, struct timespec *sent) {
+  int logidx = round_pass(round), again = 0;
+
+  if (logidx != -1) {	// not when its pass has been reused already
+    if (histlog[logidx].data[tp->num].color) {	// probed twice in a round, a reload moved it past nexttarget
+      window_remove(tp, logidx, round);
+      again = 1;
+    }
+    histlog[logidx].data[tp->num].rtt = rtt;
+    histlog[logidx].data[tp->num].color = color;
+    window_add(tp, logidx, round);
+    if (again) window_requeue(tp);
+  }
+  if (logfd != -1) log_probe(tp, sent, rtt, color);
+  update_screen('g');
+}
+
+int round_pass(int round) {	// the histlog pass of a ping round, -1 when it isn't in there (any more)
+  if ((round > pinground) || (pinground-round >= HISTLOG)) return -1;
+  return (currlog+HISTLOG-(pinground-round))%HISTLOG;
+}
+
+void window_add(target *tp, int logidx, int round) {	// O(1), with min/max in monotonic deques of ping rounds
+  double d;
+  unsigned int rtt = histlog[logidx].data[tp->num].rtt;
+  window *w = &tp->win;
+
+  w->count++;
+  switch (histlog[logidx].data[tp->num].color) {
+    case STATE_LOSS: w->losscount++;
+                     return;
+    case STATE_LAG:  w->delaycount++;
+                     break;
+    case STATE_OK:   w->okcount++;
+                     w->oksum += rtt;
+  }
+  w->n++;
+  d = rtt - w->mean;
+  w->mean += d/w->n;
+  w->m2 += d*(rtt-w->mean);
+  sketch_add(&w->quant, rtt);
+
+  deque_insert(tp, w->minq, &w->minhead, &w->minlen, round, rtt, 0);
+  deque_insert(tp, w->maxq, &w->maxhead, &w->maxlen, round, rtt, 1);
+}
+
+void deque_insert(target *tp, int *q, int *head, int *len, int round, unsigned int rtt, int max) {
+  int k, j, n, tail[HISTLOG];
+  unsigned int v;
+
+  for (k = *len; k && (q[(*head+k-1)%HISTLOG] > round); k--);	// a late result goes before the newer rounds
+  if (k < *len) {	// no use if a newer sample is as low (or high) already
+    v = histlog[round_pass(q[(*head+k)%HISTLOG])].data[tp->num].rtt;
+    if (max?v >= rtt:v <= rtt) return;
+  }
+  for (j = k; j; j--) {	// older samples it outdoes are no use any more
+    v = histlog[round_pass(q[(*head+j-1)%HISTLOG])].data[tp->num].rtt;
+    if (max?v > rtt:v < rtt) break;
+  }
+  for (n = 0; k+n < *len; n++) tail[n] = q[(*head+k+n)%HISTLOG];
+  q[(*head+j)%HISTLOG] = round;
+  for (k = 0; k < n; k++) q[(*head+j+1+k)%HISTLOG] = tail[k];
+  *len = j+1+n;
+}
+
+void window_requeue(target *tp) {	// the min/max deques from scratch, after a sample was replaced
+  int c, p, color;
+  window *w = &tp->win;
+
+  w->minlen = w->maxlen = 0;
+  for (c = HISTLOG-1; c >= 0; c--) {	// oldest round first
+    if ((p = round_pass(pinground-c)) == -1) continue;
+    color = histlog[p].data[tp->num].color;
+    if (!color || (color == STATE_LOSS)) continue;
+    deque_insert(tp, w->minq, &w->minhead, &w->minlen, pinground-c, histlog[p].data[tp->num].rtt, 0);
+    deque_insert(tp, w->maxq, &w->maxhead, &w->maxlen, pinground-c, histlog[p].data[tp->num].rtt, 1);
+  }
+}
+
+void window_remove(target *tp, int logidx, int round) {
+  double d;
+  unsigned int rtt = histlog[logidx].data[tp->num].rtt;
+  window *w = &tp->win;
+
+  w->count--;
+  switch (histlog[logidx].data[tp->num].color) {
+    case STATE_LOSS: w->losscount--;
+                     return;
+    case STATE_LAG:  w->delaycount--;
+                     break;
+    case STATE_OK:   w->okcount--;
+                     w->oksum -= rtt;
+  }
+  if (!--w->n) w->mean = w->m2 = 0;
+  else {
+    d = rtt - w->mean;
+    w->mean -= d/w->n;
+    w->m2 -= d*(rtt-w->mean);
+    if (w->m2 < 0) w->m2 = 0;	// rounding
+  }
+  sketch_remove(&w->quant, rtt);
+
+  if (w->minlen && (w->minq[w->minhead] == round)) {
+    w->minhead = (w->minhead+1)%HISTLOG;
+    w->minlen--;
+  }
+  if (w->maxlen && (w->maxq[w->maxhead] == round)) {
+    w->maxhead = (w->maxhead+1)%HISTLOG;
+    w->maxlen--;
+  }
+}
+
+int sketch_bucket(unsigned int v) {
+  int msb;
+
+  if (v < 2*SKETCHSUB) return v;	// exact
+  msb = 31-__builtin_clz(v);
+  return SKETCHSUB*(msb-3) + (v>>(msb-4)) - SKETCHSUB;	// 16 sub-buckets per power of 2
+}
+
+void sketch_add(sketch *sk, unsigned int v) {
+  sk->total++;
+  sk->count[sketch_bucket(v)]++;
+}
+
+void sketch_remove(sketch *sk, unsigned int v) {
+  sk->total--;
+  sk->count[sketch_bucket(v)]--;
+}
+
+void sketch_quantiles(sketch *sk, double *q, int n, unsigned int *v, unsigned int min, unsigned int max) {	// q ascending, all in one pass; UINT_MAX when empty
+  int b, i, msb;
+  unsigned int rank, sum = 0;
+
+  for (b = 0, i = 0; i < n; i++) {
+    if (!sk->total) {
+      v[i] = UINT_MAX;
+      continue;
+    }
+    rank = ceil(q[i]*sk->total);
+    if (!rank) rank = 1;
+    for (; (b < SKETCHBUCKETS-1) && (sum+sk->count[b] < rank); b++) sum += sk->count[b];
+    if (b < 2*SKETCHSUB) v[i] = b;
+    else {
+      msb = b/SKETCHSUB+3;
+      v[i] = ((b%SKETCHSUB+SKETCHSUB)<<(msb-4)) + (1<<(msb-5));	// middle of the bucket
+    }
+    if (v[i] < min) v[i] = min;	// the middle of the first or last bucket may lie beyond what went in
+    if (v[i] > max) v[i] = max;
   }
+}
 
-  if (currtarget->id != currid) waddch(grid, ' ');
-  waddch(grid, GRIDMARK);
-  currid = currtarget->id;
-  currtarget->waitping = pinground;
+unsigned int sketch_top(int b) {	// the largest value that goes in bucket b
+  int msb;
 
-  print_status("Ping round %d / Monitoring %d hosts / Estimated local latency: %d ms", pinground, ntargets, ell);
+  if (b < 2*SKETCHSUB) return b;
+  msb = b/SKETCHSUB+3;
+  return ((b%SKETCHSUB+SKETCHSUB+1)<<(msb-4)) - 1;
+}
 
-  update_screen('a');
+unsigned int sketch_quantile(sketch *sk, double q, unsigned int min, unsigned int max) {	// returns UINT_MAX when empty
+  unsigned int v;
 
-  send_ping(currtarget);
+  sketch_quantiles(sk, &q, 1, &v, min, max);
+  return v;
+}
 
-  memcpy(&temptv, &currtv, sizeof(struct timeval));
-  gettimeofday(&currtv, NULL);
-  temptv = tvsub(currtv, temptv);       // time lost in function
-  temptv = tvsub(tvinterval, temptv);   // interval minus drift correction
-  nexttv = tvadd(currtv, temptv);       // next time function needs to run
-  return temptv;                        // timeout for select()
+long tsdiff(struct timespec left, struct timespec right) {	// in microseconds
+  return (left.tv_sec-right.tv_sec)*1000000L + (left.tv_nsec-right.tv_nsec)/1000;
 }
 
-int tvcmp(struct timeval left, struct timeval right) {
-  if (left.tv_sec > right.tv_sec) return 1;
-  if (left.tv_sec < right.tv_sec) return -1;
-  if (left.tv_usec > right.tv_usec) return 1;
-  if (left.tv_usec < right.tv_usec) return -1;
+int start_shards(void) {	// the workers send, timestamp and match the probes of the hosts with num%nshards == theirs
+  int c, r;
+  sigset_t sigs, oldsigs;
+  struct epoll_event ev;
+  shard *sh;
+
+  sigfillset(&sigs);	// signals are for the main thread
+  pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+  for (c = 0; c < nshards; c++) {
+    sh = &shards[c];
+    for (r = 0; r < MAXINFLIGHT; r++) sh->sent[r].tnum = -1;
+    if ((ring_init(&sh->cmds, sizeof(command)) == -1) || (ring_init(&sh->replies, sizeof(reply)) == -1)) return -1;
+    ev.events = EPOLLIN;
+    ev.data.fd = sh->replies.fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sh->replies.fd, &ev);
+    if ((r = pthread_create(&sh->thread, NULL, worker, sh))) {
+      fprintf(stderr, "pthread_create(): %s\n", strerror(r));
+      return -1;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
   return 0;
 }
 
-struct timeval tvsub(struct timeval left, struct timeval right) {
-  struct timeval r;
+void *worker(void *arg) {
+  int c, r, wfd;
+  shard *sh = (shard *)arg;
+  struct epoll_event ev, events[3];
+
+  if ((wfd = epoll_create1(0)) == -1) {
+    perror("epoll_create1()");
+    exit(-6);
+  }
+  ev.events = EPOLLIN;
+  ev.data.fd = sh->sock4;
+  epoll_ctl(wfd, EPOLL_CTL_ADD, sh->sock4, &ev);
+  ev.data.fd = sh->sock6;
+  epoll_ctl(wfd, EPOLL_CTL_ADD, sh->sock6, &ev);
+  ev.data.fd = sh->cmds.fd;
+  epoll_ctl(wfd, EPOLL_CTL_ADD, sh->cmds.fd, &ev);
+
+  while (1) {
+    if ((r = epoll_wait(wfd, events, 3, -1)) == -1) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait()");
+      exit(-6);
+    }
+    for (c = 0; c < r; c++) {	// TX timestamps before replies, so these can use them
+      if (events[c].events & EPOLLERR) read_errqueue(sh, events[c].data.fd);
+    }
+    for (c = 0; c < r; c++) {
+      if (events[c].data.fd == sh->cmds.fd) read_commands(sh);
+      else if (events[c].events & EPOLLIN) read_socket(sh, events[c].data.fd);
+    }
+    if (sh->txq4.len) flush_queue(sh, &sh->txq4);
+    if (sh->txq6.len) flush_queue(sh, &sh->txq6);
+    ring_signal(&sh->replies);
+  }
+}
 
-  r.tv_sec = left.tv_sec - right.tv_sec;
-  r.tv_usec = left.tv_usec - right.tv_usec;
+void read_commands(shard *sh) {
+  unsigned int head = sh->cmds.head, tail = ring_avail(&sh->cmds);
 
-  if (r.tv_usec < 0) {
-    r.tv_sec--;
-    r.tv_usec += 1000000;
+  for (; head != tail; head++) {
+    send_ping(sh, (command *)(sh->cmds.recs+(head%RINGSIZE)*sizeof(command)));
+    __atomic_store_n(&sh->cmds.head, head+1, __ATOMIC_RELEASE);
   }
-  if (r.tv_sec < 0) {
-    r.tv_sec = 0;
-    r.tv_usec = 0;
+}
+
+void read_socket(shard *sh, int sock) {
+  int c, r;
+  static __thread char packets[BATCHSIZE][MAXPACKET], control[BATCHSIZE][CMSGSIZE];
+  static __thread struct sockaddr_storage from[BATCHSIZE];
+  static __thread struct iovec iov[BATCHSIZE];
+  static __thread struct mmsghdr msgs[BATCHSIZE];
+  struct cmsghdr *cmsg;
+  struct timespec now, rxts;
+  sentprobe *sp;
+  reply rp;
+
+  do {
+    for (c = 0; c < BATCHSIZE; c++) {
+      iov[c].iov_base = packets[c];
+      iov[c].iov_len = MAXPACKET;
+      memset(&msgs[c], 0, sizeof(struct mmsghdr));
+      msgs[c].msg_hdr.msg_name = &from[c];
+      msgs[c].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+      msgs[c].msg_hdr.msg_iov = &iov[c];
+      msgs[c].msg_hdr.msg_iovlen = 1;
+      msgs[c].msg_hdr.msg_control = control[c];
+      msgs[c].msg_hdr.msg_controllen = CMSGSIZE;
+    }
+    r = recvmmsg(sock, msgs, BATCHSIZE, MSG_DONTWAIT, NULL);
+    if (r == -1) {
+      if ((errno != EINTR) && (errno != EAGAIN)) perror("recvmmsg()");
+      return;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);	// fallback when the kernel didn't stamp a packet
+    count_batch(&sh->rxstats, r);
+    for (c = 0; c < r; c++) {
+      if (parse_packet(sh, packets[c], msgs[c].msg_len, &from[c], &rp) == -1) continue;
+      rxts = now;
+      for (cmsg = CMSG_FIRSTHDR(&msgs[c].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[c].msg_hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET) continue;
+        if ((cmsg->cmsg_type == SCM_TIMESTAMPNS) || (cmsg->cmsg_type == SCM_TIMESTAMPING)) {
+          rxts = *(struct timespec *)CMSG_DATA(cmsg);	// the software stamp is the first of scm_timestamping
+        }
+      }
+      sp = &sh->sent[rp.seq%MAXINFLIGHT];
+      if ((sp->seq == rp.seq) && (sp->tnum == rp.tnum)) rp.sent = sp->sent;	// otherwise trust the payload
+      rp.rtt = tsdiff(rxts, rp.sent) < 0?0:tsdiff(rxts, rp.sent);
+      ring_put(&sh->replies, &rp);
+    }
+  } while (r == BATCHSIZE);	// there may be more waiting
+}
+
+void read_errqueue(shard *sh, int sock) {
+  char data[MAXPACKET], control[CMSGSIZE];
+  unsigned short seq;
+  sentprobe *sp;
+  txqueue *q = (sock == sh->sock4?&sh->txq4:&sh->txq6);
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct timespec *txts;
+  struct sock_extended_err *ee;
+
+  while (1) {
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) == -1) {
+      if ((errno != EINTR) && (errno != EAGAIN)) perror("recvmsg(MSG_ERRQUEUE)");
+      return;
+    }
+
+    txts = NULL;
+    ee = NULL;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPING)) txts = (struct timespec *)CMSG_DATA(cmsg);
+      else if (((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_RECVERR))
+            || ((cmsg->cmsg_level == SOL_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR))) ee = (struct sock_extended_err *)CMSG_DATA(cmsg);
+    }
+    if (!txts || !ee || (ee->ee_errno != ENOMSG) || (ee->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)) continue;
+
+    seq = q->keyseq[ee->ee_data%MAXINFLIGHT];
+    sp = &sh->sent[seq%MAXINFLIGHT];
+    if ((sp->tnum == -1) || (sp->seq != seq)) continue;
+    if ((tsdiff(*txts, sp->sent) < 0) || (tsdiff(*txts, sp->sent) > 1000000)) continue;	// not the packet we think it is
+    sp->sent = *txts;
+  }
+}
+
+int ring_init(ring *rg, int recsize) {
+  if ((rg->fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+    perror("eventfd()");
+    return -1;
+  }
+  if (!(rg->recs = (char *)malloc(RINGSIZE*recsize))) {
+    perror("malloc()");
+    return -1;
+  }
+  rg->recsize = recsize;
+  return 0;
+}
+
+int ring_put(ring *rg, void *rec) {	// producer
+  unsigned int head = __atomic_load_n(&rg->head, __ATOMIC_ACQUIRE), tail = rg->tail;
+
+  if (tail-head == RINGSIZE) {
+    __atomic_store_n(&rg->drops, rg->drops+1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  memcpy(rg->recs+(tail%RINGSIZE)*rg->recsize, rec, rg->recsize);
+  __atomic_store_n(&rg->tail, tail+1, __ATOMIC_RELEASE);
+  if (tail+1-head > rg->maxdepth) __atomic_store_n(&rg->maxdepth, tail+1-head, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void ring_signal(ring *rg) {	// producer, after a batch of ring_put()s
+  unsigned long long one = 1;
+
+  if (rg->tail == rg->signalled) return;
+  rg->signalled = rg->tail;
+  if (write(rg->fd, &one, sizeof(one)) == -1) perror("write(eventfd)");
+}
+
+unsigned int ring_avail(ring *rg) {	// consumer; returns the tail, the records up to it can be read
+  unsigned int tail;
+  unsigned long long n;
+
+  if ((read(rg->fd, &n, sizeof(n)) == -1) && (errno != EAGAIN)) perror("read(eventfd)");	// before looking at the tail
+  tail = __atomic_load_n(&rg->tail, __ATOMIC_ACQUIRE);
+  rg->depthsum += tail-rg->head;
+  rg->drains++;
+  return tail;
+}
+
+void read_replies(shard *sh) {
+  unsigned int head = sh->replies.head, tail = ring_avail(&sh->replies);
+
+  for (; head != tail; head++) {
+    print_packet(sh, (reply *)(sh->replies.recs+(head%RINGSIZE)*sizeof(reply)));
+    __atomic_store_n(&sh->replies.head, head+1, __ATOMIC_RELEASE);
+  }
+}
+
+void count_batch(batchstats *bs, int n) {	// each batchstats has a single writer
+  __atomic_store_n(&bs->calls, bs->calls+1, __ATOMIC_RELAXED);
+  __atomic_store_n(&bs->packets, bs->packets+n, __ATOMIC_RELAXED);
+  if (n > bs->max) __atomic_store_n(&bs->max, n, __ATOMIC_RELAXED);
+}
+
+void total_batch(batchstats *rx, batchstats *tx) {	// adds up the workers' batchstats
+  int c;
+
+  memset(rx, 0, sizeof(batchstats));
+  memset(tx, 0, sizeof(batchstats));
+  for (c = 0; c < nshards; c++) {
+    rx->calls += __atomic_load_n(&shards[c].rxstats.calls, __ATOMIC_RELAXED);
+    rx->packets += __atomic_load_n(&shards[c].rxstats.packets, __ATOMIC_RELAXED);
+    tx->calls += __atomic_load_n(&shards[c].txstats.calls, __ATOMIC_RELAXED);
+    tx->packets += __atomic_load_n(&shards[c].txstats.packets, __ATOMIC_RELAXED);
+  }
+}
+
+void read_input(void) {
+  int r;
+  static int ntyped = 0;
+  static char typed[IDLEN+1];	// the id being typed, up to idwidth characters
+  target *tp;
+
+  if ((r = getc(stdin)) == EOF) {
+    perror("getc(stdin)");
+    exit(-7);
+  }
+  r = toupper(r);
+  if (r == '\r') {
+    if (showdown && ndown) showdown = 0;
+    else if (showdown == 2) showdown = 1;
+    else if (ndown) {
+      showdown = 1;
+      print_down();
+    }
+    else showdown = 2;
+  }
+  else if (r == ' ') {
+    if (showtree) {
+      showtree = 0;
+      mvwin(downlist, 1, cols-40);
+    }
+    else {
+      showtree = 1;
+      mvwin(downlist, 1, cols-40-(maxwidth+5));
+    }
+  }
+  else if (r == '<') page_grid(-1);
+  else if (r == '>') page_grid(1);
+  else if (r && strchr(IDSEQUENCE, r)) {
+    typed[ntyped++] = r;
+    if (ntyped < idwidth) return;
+    typed[ntyped] = '\0';
+    for (tp = targets; tp; tp = tp->next) {
+      if (!strcmp(tp->id, typed)) break;
+    }
+    if (tp && (tp == showinfo)) showinfo = NULL;
+    else if (tp) {
+      showinfo = tp;
+      print_info();
+    }
+  }
+  else if ((r == '!') && showinfo) {
+    if (showinfo->st->beepmode++ == 2) showinfo->st->beepmode = 0;
+    print_info();
+  }
+  ntyped = 0;
+  update_screen('f');
+}
+
+int sockaddr_equal(struct sockaddr_storage *a, struct sockaddr_storage *b) {
+  if (a->ss_family != b->ss_family) return 0;
+
+  switch (a->ss_family) {
+    case AF_INET:
+    {
+      struct sockaddr_in *a4 = (struct sockaddr_in *) a;
+      struct sockaddr_in *b4 = (struct sockaddr_in *) b;
+      return a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+    }
+    case AF_INET6:
+    {
+      struct sockaddr_in6 *a6 = (struct sockaddr_in6 *) a;
+      struct sockaddr_in6 *b6 = (struct sockaddr_in6 *) b;
+      return memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+    }
+    default:
+      exit(-1);
+  }
+}
+
+unsigned int fnv_hash(void *data, int len) {	// FNV-1a
+  int c;
+  unsigned char *cp = (unsigned char *)data;
+  unsigned int hash = 2166136261u;
+
+  for (c = 0; c < len; c++) hash = (hash ^ cp[c]) * 16777619u;
+  return hash;
+}
+
+unsigned int sockaddr_hash(struct sockaddr_storage *sas) {
+  if (sas->ss_family == AF_INET) return fnv_hash(&((struct sockaddr_in *)sas)->sin_addr, sizeof(struct in_addr));
+  return fnv_hash(&((struct sockaddr_in6 *)sas)->sin6_addr, sizeof(struct in6_addr));
+}
+
+int index_targets(void) {	// also after a reload
+  unsigned int c, size;
+  target *tp;
+
+  free(tlist);
+  if (!(tlist = (target **)malloc(sizeof(target *)*(ntargets+1)))) {
+    perror("malloc()");
+    return -1;
+  }
+  for (c = 0, tp = targets; tp; tp = tp->next) tlist[c++] = tp;
+  if (firstcol >= ntargets) firstcol = 0;
+
+  free(bynum);
+  for (nbynum = 0, tp = targets; tp; tp = tp->next) {
+    if (tp->num >= nbynum) nbynum = tp->num+1;
+  }
+  if (!(bynum = (target **)calloc(nbynum+1, sizeof(target *)))) {
+    perror("calloc()");
+    return -1;
+  }
+  for (tp = targets; tp; tp = tp->next) bynum[tp->num] = tp;
+
+  free(addrhash);
+  for (size = 16; size < 2*ntargets; size <<= 1);
+  if (!(addrhash = (target **)malloc(sizeof(target *)*size))) {
+    perror("malloc()");
+    return -1;
+  }
+  memset(addrhash, 0, sizeof(target *)*size);
+  addrmask = size-1;
+
+  for (tp = targets; tp; tp = tp->next) {
+    for (c = sockaddr_hash(tp->addr)&addrmask; addrhash[c]; c = (c+1)&addrmask) {
+      if (sockaddr_equal(addrhash[c]->addr, tp->addr)) break;	// Listed twice; the first one gets the replies
+    }
+    if (!addrhash[c]) addrhash[c] = tp;
+  }
+  return 0;
+}
+
+target *find_target(struct sockaddr_storage *sas) {
+  unsigned int c;
+
+  for (c = sockaddr_hash(sas)&addrmask; addrhash[c]; c = (c+1)&addrmask) {
+    if (sockaddr_equal(addrhash[c]->addr, sas)) return addrhash[c];
+  }
+  return NULL;
+}
+
+const char *sockaddr_print(struct sockaddr_storage *sas) {
+  static char buf[INET6_ADDRSTRLEN];
+  void *addr = (sas->ss_family==AF_INET?(void *)&((struct sockaddr_in *)sas)->sin_addr:(void *)&((struct sockaddr_in6 *)sas)->sin6_addr);
+  return inet_ntop(sas->ss_family, addr, buf, INET6_ADDRSTRLEN);
+}
+
+int parse_packet(shard *sh, char *packet, int len, struct sockaddr_storage *from, reply *rp) {	// worker; -1 if it isn't one of our replies
+  payload *pl;
+
+  memset(rp, 0, sizeof(reply));
+  rp->family = from->ss_family;
+  if (from->ss_family == AF_INET) {
+    struct ip *ip = (struct ip *)packet;
+    int hlen = tport->iphdr?ip->ip_hl << 2:0;
+    len -= hlen;
+    if (len < ICMP_MINLEN + (int)sizeof(payload)) return -1;
+    struct icmp *icp = (struct icmp *)(packet + hlen);
+    if (tport->ownid && (ntohs(icp->icmp_id) != sh->id)) return -1;
+    rp->seq = ntohs(icp->icmp_seq);
+    if ((icp->icmp_type != 0) || (icp->icmp_code != 0)) return -1;
+    pl = (payload *)icp->icmp_data;
+    rp->from.v4 = ((struct sockaddr_in *)from)->sin_addr;
+  }
+  else {
+    struct icmp6_hdr *icp = (struct icmp6_hdr *)packet;
+    if (len < (int)(sizeof(struct icmp6_hdr) + sizeof(payload))) return -1;
+    if (tport->ownid && (ntohs(icp->icmp6_id) != sh->id)) return -1;
+    rp->seq = ntohs(icp->icmp6_seq);
+    if ((icp->icmp6_type != ICMP6_ECHO_REPLY) || (icp->icmp6_code != 0)) return -1;
+    pl = (payload *)&(icp->icmp6_data16[2]); // skip the id and seq fields which are part of the ICMP6 data
+    rp->from.v6 = ((struct sockaddr_in6 *)from)->sin6_addr;
+  }
+  rp->tnum = pl->tnum;
+  rp->tseq = pl->tseq;
+  rp->sent.tv_sec = pl->sent.tv_sec;
+  rp->sent.tv_nsec = pl->sent.tv_usec*1000;
+  return 0;
+}
+
+void print_packet(shard *sh, reply *rp) {
+  int seq = rp->seq;
+  long r = rp->rtt;
+  unsigned int ampl;
+  char via[INET6_ADDRSTRLEN+6] = "";
+  target *tp;
+  probe *pp;
+  struct sockaddr_storage sas, *from = &sas;
+
+  memset(&sas, 0, sizeof(sas));
+  sas.ss_family = rp->family;
+  if (rp->family == AF_INET) ((struct sockaddr_in *)&sas)->sin_addr = rp->from.v4;
+  else ((struct sockaddr_in6 *)&sas)->sin6_addr = rp->from.v6;
+
+  pp = &sh->inflight[seq%MAXINFLIGHT];
+  if (pp->target && (pp->seq == seq) && (pp->target->num == rp->tnum)) {	// Fast path: the probe is still in the table
+    tp = pp->target;
+    pp->sent = rp->sent;	// the worker's timestamp, for the log
+    if (!sockaddr_equal(tp->addr, from)) snprintf(via, sizeof(via), " via %s", sockaddr_print(from));
+  }
+  else if (!(tp = find_target(from)) && ((rp->tnum < 0) || (rp->tnum >= nbynum) || !(tp = bynum[rp->tnum]))) return;
+
+  if ((pp->target != tp) || (pp->seq != seq)) pp = NULL;	// it has left the table, already answered or long ago
+  else if (pp->train) {	// a late one was counted as lost already
+    pp->target = NULL;
+    timer_del(&pp->timer);
+    if (!pp->lost) train_result(tp, pp, r);
+    return;
+  }
+  if (rp->tseq == UINT_MAX) return;	// a train packet that has been dealt with
+
+  switch (seq_order(tp, rp->tseq)) {
+    case SEQ_DUPLICATE: tp->st->dupcount++;
+                        wattron(scroller, COLOR_PAIR(7));
+                        print_scroll("%s  %-40.40s %-40s %6s ms  (duplicate)%s", tp->id, tp->name, tp->ipstr, ustoms(r), via);
+                        if (tp == showinfo) update_screen('i');
+                        return;
+    case SEQ_REORDERED: tp->st->reordercount++;
+                        break;
+  }
+  if (pp) {
+    pp->target = NULL;
+    timer_del(&pp->timer);
+  }
+  update_rto(tp->st, r);	// late replies too, so a deadline that was too short gets longer
+
+  if (pp && !pp->lost) {
+    tp->st->rttlast = r;
+    tp->st->rttsum += r;
+    tp->st->rttavg = tp->st->rttsum / (tp->st->probecount - tp->st->losscount + tp->st->latecount);
+    tp->st->sqsum += (double)r*r;
+    sketch_add(&tp->st->quant, r);
+    if (r < tp->st->rttmin) tp->st->rttmin = r;
+    if (r > tp->st->rttmax) tp->st->rttmax = r;
+    if (!tp->st->okcount) tp->st->okavg = r;
+    else if ((tp->st->probecount > LEARNROUNDS) && track_baseline(tp->st, r)) {
+      report("%s %s [%s]: baseline moved to %s ms", tp->id, tp->name, tp->ipstr, ustoms(tp->st->okavg));
+    }
+    ampl = tp->st->okdev;
+
+    if (tp->st->treecolor == STATE_LOSS) {
+      tp->st->downsince = 0;
+      ndown--;
+    }
+    if ((tp->st->probecount <= LEARNROUNDS) || (r <= tp->st->okavg+JITMULT*(ampl>AMPLMIN?ampl:AMPLMIN))
+     || (r <= sketch_quantile(&tp->st->quant, JITQUANT, tp->st->rttmin, tp->st->rttmax))) {
+      wattron(scroller, COLOR_PAIR(STATE_OK));
+      if ((tp->st->lastcolor >= STATE_OK) && (tp->st->treecolor != STATE_OK)) {
+        tp->st->treecolor = STATE_OK;
+        print_treehost(tp);
+      }
+      tp->st->lastcolor = STATE_OK;
+      tp->st->okcount++;
+      tp->st->oksum += r;
+      ok_baseline(tp->st, r);
+      log_result(tp, pp->round, r, STATE_OK, &pp->sent);
+    }
+//    else if ((r <= LAGMULT*tp->st->rttmin) || (r <= LAGMIN)) {
+    else if (r <= tp->st->okavg+LAGMULT*(ampl>AMPLMIN?ampl:AMPLMIN)) {
+      wattron(scroller, COLOR_PAIR(STATE_JIT));
+      if ((tp->st->lastcolor >= STATE_JIT) && (tp->st->treecolor != STATE_JIT)) {
+        tp->st->treecolor = STATE_JIT;
+        print_treehost(tp);
+      }
+      tp->st->lastcolor = STATE_JIT;
+      log_result(tp, pp->round, r, STATE_JIT, &pp->sent);
+    }
+    else {
+      wattron(scroller, COLOR_PAIR(STATE_LAG));
+      tp->st->delaycount++;
+      if ((tp->st->lastcolor >= STATE_LAG) && (tp->st->treecolor != STATE_LAG)) {
+        tp->st->treecolor = STATE_LAG;
+        print_treehost(tp);
+      }
+      tp->st->lastcolor = STATE_LAG;
+      log_result(tp, pp->round, r, STATE_LAG, &pp->sent);
+    }
+    if ((tp->st->beepmode == 1) && !headless) beep();
+    aggregate(tp);
+  }
+  else {	// counted as lost, but it still has a real RTT
+    tp->st->latecount++;
+    tp->st->rttlast = r;
+    tp->st->rttsum += r;
+    tp->st->rttavg = tp->st->rttsum / (tp->st->probecount - tp->st->losscount + tp->st->latecount);
+    tp->st->sqsum += (double)r*r;
+    sketch_add(&tp->st->quant, r);
+    if (r < tp->st->rttmin) tp->st->rttmin = r;
+    if (r > tp->st->rttmax) tp->st->rttmax = r;
+    if (pp && (round_pass(pp->round) != -1)) histlog[round_pass(pp->round)].data[tp->num].rtt = r;	// the pass keeps it as lost
+    if (logfd != -1) log_probe(tp, &rp->sent, r, REC_LATE);
+    aggregate(tp);
+    wattron(scroller, COLOR_PAIR(7));
+    if (tp == showinfo) update_screen('i');
+    print_scroll("%s  %-40.40s %-40s %6s ms  (late)%s", tp->id, tp->name, tp->ipstr, ustoms(r), via);
+    return;
+  }
+
+  if (tp == showinfo) update_screen('i');
+
+  print_scroll("%s  %-40.40s %-40s %6s ms  (baseline %s ± %s)%s", tp->id, tp->name, tp->ipstr, ustoms(r), ustoms(tp->st->okavg), ustoms(ampl), via);
+}
+
+int track_baseline(statedata *sd, unsigned int r) {	// EWMA of the ok replies, moved by a CUSUM on a level shift; returns 1 then
+  double z = ((double)r - sd->okavg)/(sd->okdev > AMPLMIN?sd->okdev:AMPLMIN);
+
+  if (z > CUSUMCLIP) z = CUSUMCLIP;
+  if (z < -CUSUMCLIP) z = -CUSUMCLIP;
+  if ((sd->cusumhi += z-CUSUMK) > 0) {
+    sd->hisum += r;
+    sd->hin++;
+  }
+  else sd->cusumhi = sd->hisum = sd->hin = 0;
+  if ((sd->cusumlo += -z-CUSUMK) > 0) {
+    sd->losum += r;
+    sd->lon++;
+  }
+  else sd->cusumlo = sd->losum = sd->lon = 0;
+
+  if ((sd->cusumhi <= CUSUMH) && (sd->cusumlo <= CUSUMH)) return 0;
+  sd->okavg = (sd->cusumhi > CUSUMH?sd->hisum/sd->hin:sd->losum/sd->lon);
+  sd->cusumhi = sd->hisum = sd->hin = 0;
+  sd->cusumlo = sd->losum = sd->lon = 0;
+  sd->rebaselines++;
+  return 1;
+}
+
+void ok_baseline(statedata *sd, unsigned int r) {	// after okcount was counted
+  long n = (sd->okcount < BASEWEIGHT?sd->okcount:BASEWEIGHT);	// a plain average until there are enough
+  long d = (long)r - sd->okavg;
+
+  sd->okavg += d/n;
+  sd->okdev += ((d < 0?-d:d) - (long)sd->okdev)/n;
+}
+
+int seq_order(target *tp, unsigned int tseq) {	// from a bit per recent probe that was answered, O(1)
+  unsigned int d = tp->tseq-1-tseq;
+
+  if ((tseq >= tp->tseq) || (d >= SEQWINDOW)) return SEQ_OLD;	// from before a restart, or too long ago to tell
+  if (tp->seqwin & 1ULL<<d) return SEQ_DUPLICATE;
+  tp->seqwin |= 1ULL<<d;
+  return (tp->seqwin & ((1ULL<<d)-1))?SEQ_REORDERED:SEQ_INORDER;	// a later probe was answered first
+}
+
+char *print_type(int t) {
+  static char *ttab[] = {
+                "Echo Reply",
+                "ICMP 1",
+                "ICMP 2",
+                "Dest Unreachable",
+                "Source Quench",
+                "Redirect",
+                "ICMP 6",
+                "ICMP 7",
+                "Echo",
+                "ICMP 9",
+                "ICMP 10",
+                "Time Exceeded",
+                "Parameter Problem",
+                "Timestamp",
+                "Timestamp Reply",
+                "Info Request",
+                "Info Reply"
+  };
+
+  if ((t < 0) || (t > 16)) return("OUT-OF-RANGE");
+
+  return ttab[t];
+}
+
+int read_targets(void) {	// starts with the hosts given by address, the others follow as their names come in
+  int c;
+  struct pollfd pfd;
+  target *tp;
+  batch *rb;
+
+  if (!(starting = parse_targets())) return -1;
+  if (!(starting->done = (ring *)calloc(RESOLVERS, sizeof(ring)))) {
+    perror("calloc()");
+    return -1;
+  }
+  for (c = 0; c < RESOLVERS; c++) {	// all of them wake up the main thread through lookupfd
+    if (!(starting->done[c].recs = (char *)malloc(RINGSIZE*sizeof(int)))) {
+      perror("malloc()");
+      return -1;
+    }
+    starting->done[c].recsize = sizeof(int);
+    starting->done[c].fd = lookupfd;
+  }
+  if (merge_targets(starting) == -1) return -1;
+  if (run_lookups(starting) == -1) return -1;
+  pfd.fd = lookupfd;
+  pfd.events = POLLIN;
+  while (!ntargets && starting) {	// nothing to probe yet, wait for the first name
+    if ((poll(&pfd, 1, -1) == -1) && (errno != EINTR)) {
+      perror("poll()");
+      return -1;
+    }
+    read_lookups();
+  }
+  if (!ntargets) return -1;
+  if (!(rb = (batch *)calloc(1, sizeof(batch)))) {
+    perror("calloc()");
+    return -1;
+  }
+  for (tp = targets; tp; tp = tp->next) add_lookup(rb, tp);	// their names, for the ones given by address
+  return run_lookups(rb);
+}
+
+batch *parse_targets(void) {	// reads the targets file into a batch of forward lookups
+  int rank, detached = 0;
+  char buf[LINEBUF+1], *tmp2;
+  struct addrinfo hints;
+  lookup *lp;
+  batch *b;
+  FILE *fp = NULL;
+
+  if (!(fp = fopen(TARGETSFILE, "r"))) {
+    report("fopen(%s): %s", TARGETSFILE, strerror(errno));
+    return NULL;
+  }
+  if (!(b = (batch *)calloc(1, sizeof(batch)))) {
+    perror("calloc()");
+    fclose(fp);
+    return NULL;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = PF_UNSPEC;
+  hints.ai_socktype = SOCK_RAW;
+  hints.ai_flags = AI_NUMERICHOST;
+
+  while (fgets(buf, LINEBUF, fp)) {
+    for (rank = 0; buf[rank] == ' '; rank++);
+    if (!buf[rank]) break;
+    if (buf[rank] == '\n') {
+      detached = 1;
+      continue;
+    }
+    strtok(&buf[rank], " \n");
+    if (b->n == b->max) {
+      b->max = b->max?2*b->max:64;
+      if (!(b->jobs = (lookup *)realloc(b->jobs, sizeof(lookup)*b->max))) {
+        perror("realloc()");
+        exit(-3);
+      }
+    }
+    lp = &b->jobs[b->n++];
+    memset(lp, 0, sizeof(lookup));
+    lp->rank = rank;
+    lp->detached = detached;
+    detached = 0;
+    if (!(lp->host = strdup(&buf[rank]))) {
+      perror("strdup()");
+      exit(-3);
+    }
+    if ((tmp2 = strtok(NULL, "\n")) && !strncmp(tmp2, "train=", 6)) {	// packet trains, before the shortname
+      if (!(lp->train = strdup(strtok(tmp2, " ")))) {
+        perror("strdup()");
+        exit(-3);
+      }
+      tmp2 = strtok(NULL, "\n");
+    }
+    if (tmp2 && !(lp->comment = strdup(tmp2))) {
+      perror("strdup()");
+      exit(-3);
+    }
+    if (getaddrinfo(lp->host, NULL, &hints, &lp->res)) {	// not an address, leave it to the resolvers
+      lp->res = NULL;
+      lp->pending = 1;
+    }
+  }
+  fclose(fp);
+  return b;
+}
+
+int merge_targets(batch *b) {	// hosts we had are matched by address and keep their slot and statistics
+  int c, i, r, n, count = 0, detached = 0, added = 0, removed = 0;
+  unsigned int mask, h;
+  int *index;
+  char ipstr[INET6_ADDRSTRLEN+1];
+  int oldwidth = idwidth;
+  target *t, *tail = NULL, **olds;
+  struct addrinfo *ai;
+  lookup *lp;
+  batch *rb = NULL;		// reverse lookups for the hosts that were added
+
+  targetsgen++;
+  for (n = 0, t = targets; t; t = t->next) n++;	// index the hosts we have by address
+  for (mask = 16; mask < 2*n; mask <<= 1);
+  if (!(olds = (target **)malloc(sizeof(target *)*(n+1))) || !(index = (int *)malloc(sizeof(int)*mask--))) {
+    perror("malloc()");
+    return -1;
+  }
+  memset(index, -1, sizeof(int)*(mask+1));
+  for (i = 0, t = targets; t; t = t->next, i++) {
+    olds[i] = t;
+    t->gone = 1;
+    for (h = fnv_hash(t->ipstr, strlen(t->ipstr))&mask; index[h] != -1; h = (h+1)&mask);
+    index[h] = i;
+  }
+
+  targets = NULL;
+  ntargets = ndetach = maxwidth = 0;
+  for (idwidth = 1, i = strlen(IDSEQUENCE); (i < b->n) && (idwidth < IDLEN); idwidth++) i *= strlen(IDSEQUENCE);
+  for (c = 0; c < b->n; c++) {
+    lp = &b->jobs[c];
+    if (lp->detached) detached = 1;
+    if (lp->pending) {	// its name is still coming in, it keeps its id
+      count++;
+      continue;
+    }
+    if (!lp->res) {
+      if (lp->err) report("- %s getaddrinfo(): %s", lp->host, gai_strerror(lp->err));
+      lp->err = 0;	// once, the startup batch is merged more than once
+      if (b == starting) {	// so the ids that were given out stay
+        count++;
+        continue;
+      }
+      for (i = r = 0; i < n; i++) {	// a resolver hiccup is no reason to drop a host, it keeps its addresses
+        t = olds[i];
+        if (!t->gone || !t->host || strcmp(t->host, lp->host)) continue;
+        for (h = fnv_hash(t->ipstr, strlen(t->ipstr))&mask; index[h] != i; h = (h+1)&mask);
+        index[h] = -2;
+        t->gone = 0;
+        t->next = NULL;
+        free(t->comment);
+        t->comment = NULL;
+        if (list_target(t, lp, !r++, count, detached, &tail) == -1) return -1;
+        detached = 0;
+      }
+      if (r) {
+        report("- %s keeps its %d previous address%s", lp->host, r, (r == 1?"":"es"));
+        count++;
+      }
+      continue;
+    }
+    i = 0;
+    for (ai = lp->res; ai; ai = ai->ai_next, i++) {
+      if (i == 10) {
+        report("- %s has more than 10 addresses, skipping...", lp->host);
+        break;
+      }
+      if ((r = getnameinfo(ai->ai_addr, ai->ai_addrlen, ipstr, 40, NULL, 0, NI_NUMERICHOST))) {
+        report("- %s getnameinfo(): %s", lp->host, gai_strerror(r));
+        continue;
+      }
+
+      for (h = fnv_hash(ipstr, strlen(ipstr))&mask; index[h] != -1; h = (h+1)&mask) {
+        if ((index[h] != -2) && !strcmp(olds[index[h]]->ipstr, ipstr)) break;
+      }
+      if (index[h] >= 0) {	// one we had
+        t = olds[index[h]];
+        index[h] = -2;	// a host listed twice gets the next target with its address
+        t->gone = 0;
+        t->next = NULL;
+        free(t->comment);
+        t->comment = NULL;
+        if (strcmp(t->host, lp->host)) {
+          free(t->host);
+          t->host = NULL;
+        }
+      }
+      else {
+        if (!(t = (target *)malloc(sizeof(target)))) {
+          perror("malloc()");
+          return -1;
+        }
+        memset(t, 0, sizeof(target));
+        if (!(t->addr = (struct sockaddr_storage *)malloc(sizeof(struct sockaddr_storage)))) {
+          perror("malloc()");
+          return -1;
+        }
+        memset(t->addr, 0, sizeof(struct sockaddr_storage));
+        memcpy(t->addr, ai->ai_addr, ai->ai_addrlen);
+        strcpy(t->ipstr, ipstr);
+        snprintf(t->name, HOSTLEN, "(%s)", lp->host);	// until start_lookups() finds the real name
+        t->num = hist?-1:ntargets;	// on a reload, add_slot() finds it a place in the history
+      }
+      if (!t->host && !(t->host = strdup(lp->host))) {
+        perror("strdup()");
+        return -1;
+      }
+      if (list_target(t, lp, !i, count, detached, &tail) == -1) return -1;
+      detached = 0;
+    }
+    count++;
+  }
+  free(index);
+
+  maxwidth += idwidth-1;
+  if (!hist) {	// at startup, open_history() takes it from here
+    for (i = 0, t = targets; t; t = t->next) t->num = i++;
+    free(olds);
+    layout_tree();
+    return 0;
+  }
+  if (!ntargets) {	// keep what we have rather than monitor nothing
+    report("No hosts left in %s, ignoring it", TARGETSFILE);
+    idwidth = oldwidth;
+    for (i = 0; i < n; i++) {
+      t = olds[i];
+      t->gone = 0;
+      t->next = (i+1 < n?olds[i+1]:NULL);
+      ntargets++;
+      if (t->detached) ndetach++;
+      if (2*t->rank+(t->comment?strlen(t->comment)+1:0) > maxwidth) maxwidth = 2*t->rank+(t->comment?strlen(t->comment)+1:0);
+    }
+    maxwidth += idwidth-1;
+    targets = olds[0];
+    free(olds);
+    layout_tree();
+    rebuild_aggregates();
+    return 0;
+  }
+
+  for (i = 0; i < n; i++) {	// nexttarget has to stay in the list, step back to a host that does
+    if ((olds[i] != nexttarget) || !olds[i]->gone) continue;
+    for (nexttarget = NULL; i && !nexttarget; i--) {
+      if (!olds[i-1]->gone) nexttarget = olds[i-1];
+    }
+    break;
+  }
+  if (showinfo && showinfo->gone) {
+    showinfo = NULL;
+    update_screen('h');	// uncovers what was under it
+  }
+  for (c = 0; c < nshards; c++) {	// cancel the probes of dropped hosts
+    for (i = 0; i < MAXINFLIGHT; i++) {
+      if (shards[c].inflight[i].target && shards[c].inflight[i].target->gone) {
+        timer_del(&shards[c].inflight[i].timer);
+        shards[c].inflight[i].target = NULL;
+      }
+    }
+  }
+  for (i = 0; i < n; i++) {
+    if (!olds[i]->gone) continue;
+    report("Removed %s %s [%s]", olds[i]->id, olds[i]->name, olds[i]->ipstr);
+    drop_target(olds[i]);
+    removed++;
+  }
+  free(olds);
+
+  for (t = targets; t; t = t->next) {
+    if (t->num != -1) continue;
+    if (!rb && !(rb = (batch *)calloc(1, sizeof(batch)))) {
+      perror("calloc()");
+      return -1;
+    }
+    add_slot(t);
+    add_lookup(rb, t);
+    if (logfd != -1) log_target(t);
+    report("Added %s %s [%s]", t->id, t->name, t->ipstr);
+    added++;
+  }
+
+  if (index_targets() == -1) return -1;
+  layout_tree();
+  rebuild_aggregates();
+  if (metricsfd != -1) {	// the ids may have shifted
+    for (t = targets; t; t = t->next) {
+      free(t->labels);
+      if (!(t->labels = metric_labels(t))) return -1;
+    }
+  }
+  sendepoch = sendtimer.expires;	// the spacing of the probes changes from here on
+  nsent = 0;
+  msync(hist, histsize, MS_ASYNC);
+  redraw_targets();
+  if (b != starting) report("Reloaded %s: %d hosts, %d added, %d removed", TARGETSFILE, ntargets, added, removed);
+  if (rb && (run_lookups(rb) == -1)) return -1;
+  return 0;
+}
+
+void add_slot(target *tp) {	// a place in the history for a host added by a reload
+  int c;
+  statedata *states = (statedata *)(hist+1);
+
+  for (tp->num = 0; tp->num < hist->ntargets; tp->num++) {	// a slot left by a dropped host, whose late replies are over
+    if (states[tp->num].ipstr[0]) continue;
+    if ((tp->num >= nslotfreed) || (timers.now >= slotfreed[tp->num]+rtomax+(unsigned long)SEQWINDOW*interval*1000)) break;	// seq_order() looks back SEQWINDOW rounds
+  }
+  if (tp->num == hist->ntargets) {
+    if ((hist->ntargets == hist->capacity) && (grow_history(hist->capacity+hist->capacity/4+16) == -1)) exit(-4);
+    hist->ntargets++;
+    states = (statedata *)(hist+1);
+  }
+  tp->st = &states[tp->num];
+  init_state(tp->st, tp);
+  for (c = 0; c < HISTLOG; c++) memset(&histlog[c].data[tp->num], 0, sizeof(pingdata));
+  if (oldhist) carry_state(tp);
+}
+
+void carry_state(target *tp) {	// for a host whose name came in after the start, what the history we started from had on it
+  int c, p, r;
+  unsigned int h;
+  statedata *oldstates = (statedata *)(oldhist+1);
+  pingdata *oldpings = (pingdata *)(oldstates+oldhist->capacity);
+
+  for (h = fnv_hash(tp->ipstr, strlen(tp->ipstr))&oldmask; oldindex[h] != -1; h = (h+1)&oldmask) {
+    if ((oldindex[h] != -2) && !strcmp(oldstates[oldindex[h]].ipstr, tp->ipstr)) break;
+  }
+  if (oldindex[h] < 0) return;
+  memcpy(tp->st, &oldstates[oldindex[h]], sizeof(statedata));
+  for (c = 1; c <= HISTLOG; c++) {	// oldest pass first; the rounds have moved on since
+    p = (oldhist->currlog+c)%HISTLOG;
+    if ((r = round_pass(oldhist->pinground-HISTLOG+c)) == -1) continue;
+    histlog[r].data[tp->num] = oldpings[p*oldhist->capacity+oldindex[h]];
+    if (histlog[r].data[tp->num].color) window_add(tp, r, oldhist->pinground-HISTLOG+c);
+  }
+  if (tp->st->treecolor == STATE_LOSS) ndown++;
+  oldindex[h] = -2;
+}
+
+void drop_oldhist(void) {	// once all the names are in
+  if (!oldhist) return;
+  munmap(oldhist, oldhistsize);
+  free(oldindex);
+  oldhist = NULL;
+}
+
+int list_target(target *t, lookup *lp, int first, int count, int detached, target **tail) {	// appends a host of lp to the new list
+  make_id(t->id, count);
+  t->rank = lp->rank;
+  t->detached = detached;
+  if (detached) ndetach++;
+  if (lp->comment && first) {
+    if (!(t->comment = strdup(lp->comment))) {	// the startup batch is merged more than once
+      perror("strdup()");
+      return -1;
+    }
+    if (2*t->rank+strlen(t->comment)+1 > maxwidth) maxwidth = 2*t->rank+strlen(t->comment)+1;
+  }
+  else if (2*t->rank > maxwidth) maxwidth = 2*t->rank;
+  if (set_train(t, lp->train) == -1) return -1;
+
+  if (!targets) targets = t;
+  else (*tail)->next = t;
+  *tail = t;
+  ntargets++;
+
+  if (!hist) {
+    if (t->comment) printf("%s %s [%s] (%s)\n", t->id, t->name, t->ipstr, t->comment);
+    else printf("%s %s [%s]\n", t->id, t->name, t->ipstr);
+  }
+  return 0;
+}
+
+void drop_target(target *tp) {	// its probes have been cancelled already
+  int c;
+  unsigned long *tmp;
+
+  if (tp->num >= nslotfreed) {
+    if (!(tmp = (unsigned long *)realloc(slotfreed, sizeof(unsigned long)*hist->capacity))) {
+      perror("realloc()");
+      exit(-4);
+    }
+    memset(&tmp[nslotfreed], 0, sizeof(unsigned long)*(hist->capacity-nslotfreed));
+    slotfreed = tmp;
+    nslotfreed = hist->capacity;
+  }
+  slotfreed[tp->num] = timers.now;
+  if (tp->st->treecolor == STATE_LOSS) ndown--;
+  for (c = 0; c < HISTLOG; c++) memset(&histlog[c].data[tp->num], 0, sizeof(pingdata));
+  memset(tp->st, 0, sizeof(statedata));	// frees the slot
+  free(tp->addr);
+  free(tp->host);
+  free(tp->comment);
+  free(tp->labels);
+  set_train(tp, NULL);
+  free(tp);
+}
+
+int grow_history(unsigned int capacity) {	// in place, moving the passes up starting with the last
+  int c, fd;
+  unsigned int old = hist->capacity;
+  size_t size = history_size(capacity);
+  histheader *h;
+  statedata *states;
+  pingdata *oldpings, *pings;
+  target *tp;
+
+  if ((fd = open(HISTFILE, O_RDWR)) == -1) {
+    report("open(%s): %s", HISTFILE, strerror(errno));
+    return -1;
+  }
+  if (ftruncate(fd, size) == -1) {
+    report("ftruncate(): %s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  if ((h = (histheader *)mremap(hist, histsize, size, MREMAP_MAYMOVE)) == MAP_FAILED) {
+    report("mremap(): %s", strerror(errno));
+    return -1;
+  }
+  hist = h;
+  histsize = size;
+  states = (statedata *)(hist+1);
+  oldpings = (pingdata *)(states+old);
+  pings = (pingdata *)(states+capacity);
+  for (c = HISTLOG-1; c >= 0; c--) {
+    memmove(&pings[c*capacity], &oldpings[c*old], sizeof(pingdata)*old);
+    memset(&pings[c*capacity+old], 0, sizeof(pingdata)*(capacity-old));
+  }
+  memset(&states[old], 0, sizeof(statedata)*(capacity-old));
+  hist->capacity = capacity;
+  for (c = 0; c < HISTLOG; c++) histlog[c].data = pings+c*capacity;
+  for (tp = targets; tp; tp = tp->next) {
+    if (tp->num >= 0) tp->st = &states[tp->num];
+  }
+  return 0;
+}
+
+void reload_targets(void) {	// on SIGHUP, or when the targets file was written
+  gotreload = 0;
+  if (reloading || starting) {	// still resolving the previous version
+    reloadagain = 1;
+    return;
+  }
+  if (!(reloading = parse_targets())) return;
+  if (run_lookups(reloading) == -1) {
+    free_batch(reloading);
+    reloading = NULL;
+  }
+}
+
+void sig_reload(int sig) {
+  gotreload = 1;
+}
+
+void read_inotify(void) {
+  int r;
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+
+  while ((r = read(inotifyfd, buf, sizeof(buf))) > 0) {
+    for (ev = (struct inotify_event *)buf; (char *)ev < buf+r; ev = (struct inotify_event *)((char *)(ev+1)+ev->len)) {
+      if (ev->len && !strcmp(ev->name, TARGETSFILE)) gotreload = 1;
+    }
+  }
+}
+
+void report(char *fmt, ...) {	// to stderr while starting up or headless, otherwise to the scroller
+  char buf[LINEBUF];
+  va_list arglist;
+
+  va_start(arglist, fmt);
+  vsnprintf(buf, LINEBUF, fmt, arglist);
+  va_end(arglist);
+  if (headless || !scroller) {
+    fprintf(stderr, "%s\n", buf);
+    if (!headless) strcpy(startlines[nstartlines++%SCROLLSIZE], buf);
+  }
+  else {
+    wattron(scroller, COLOR_PAIR(8));
+    print_scroll("%s", buf);
+  }
+}
+
+void announce(char *fmt, ...) {	// startup messages to stdout, the scroller repeats them
+  char buf[LINEBUF];
+  va_list arglist;
+
+  va_start(arglist, fmt);
+  vsnprintf(buf, LINEBUF, fmt, arglist);
+  va_end(arglist);
+  printf("%s\n", buf);
+  if (!headless) strcpy(startlines[nstartlines++%SCROLLSIZE], buf);
+}
+
+int run_lookups(batch *b) {	// on up to RESOLVERS threads, the main thread is told through lookupfd
+  int c, r, n;
+  pthread_t thread;
+  sigset_t sigs, oldsigs;
+
+  n = b->n < RESOLVERS?b->n:RESOLVERS;
+  b->next = 0;
+  b->left = n;
+  if (!b->n) {	// as if the resolvers were done with it
+    b->nextdone = batchesdone;
+    batchesdone = b;
+    read_lookups();
+    return 0;
+  }
+  sigfillset(&sigs);	// signals are for the main thread
+  pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+  for (c = 0; c < n; c++) {
+    if ((r = pthread_create(&thread, NULL, resolver, b))) {
+      report("pthread_create(): %s", strerror(r));
+      pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+      return -1;
+    }
+    pthread_detach(thread);
+  }
+  pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+  return 0;
+}
+
+void *resolver(void *arg) {
+  unsigned long long one = 1;
+  unsigned int idx;
+  struct addrinfo hints;
+  lookup *lp;
+  batch *b = (batch *)arg;
+  ring *done = b->done?&b->done[__atomic_fetch_add(&b->threads, 1, __ATOMIC_RELAXED)]:NULL;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = PF_UNSPEC;
+  hints.ai_socktype = SOCK_RAW;
+
+  while ((idx = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->n) {
+    lp = &b->jobs[idx];
+    if (!b->reverse) {
+      if (lp->res) continue;
+      lp->err = getaddrinfo(lp->host, NULL, &hints, &lp->res);
+      if (done && (ring_put(done, &idx) == 0)) ring_signal(done);	// if it's full, the host comes with the rest
+    }
+    else if (!getnameinfo((struct sockaddr *)&lp->addr, lp->addr.ss_family == AF_INET?sizeof(struct sockaddr_in):sizeof(struct sockaddr_in6), lp->name, HOSTLEN, NULL, 0, 0)) {
+      pthread_mutex_lock(&lookuplock);	// otherwise the host keeps its placeholder
+      lp->next = lookupsdone;
+      lookupsdone = lp;
+      pthread_mutex_unlock(&lookuplock);
+      if (write(lookupfd, &one, sizeof(one)) == -1) perror("write(eventfd)");
+    }
+  }
+  if (__atomic_sub_fetch(&b->left, 1, __ATOMIC_ACQ_REL) == 0) {	// b may be freed as soon as it's on the list
+    pthread_mutex_lock(&lookuplock);
+    b->nextdone = batchesdone;
+    batchesdone = b;
+    pthread_mutex_unlock(&lookuplock);
+    if (write(lookupfd, &one, sizeof(one)) == -1) perror("write(eventfd)");
+  }
+  return NULL;
+}
+
+void add_lookup(batch *b, target *tp) {	// a reverse lookup
+  if (b->n == b->max) {
+    b->max = b->max?2*b->max:64;
+    if (!(b->jobs = (lookup *)realloc(b->jobs, sizeof(lookup)*b->max))) {
+      perror("realloc()");
+      exit(-7);
+    }
+  }
+  memset(&b->jobs[b->n], 0, sizeof(lookup));
+  memcpy(&b->jobs[b->n++].addr, tp->addr, sizeof(struct sockaddr_storage));
+  b->reverse = 1;
+}
+
+void free_batch(batch *b) {
+  int c;
+
+  for (c = 0; c < b->n; c++) {
+    free(b->jobs[c].host);
+    free(b->jobs[c].comment);
+    free(b->jobs[c].train);
+    if (b->jobs[c].res) freeaddrinfo(b->jobs[c].res);
+  }
+  if (b->done) {
+    for (c = 0; c < RESOLVERS; c++) free(b->done[c].recs);
+    free(b->done);
+  }
+  free(b->jobs);
+  free(b);
+}
+
+int start_lookups(void) {
+  if ((lookupfd = eventfd(0, EFD_NONBLOCK)) == -1) {
+    perror("eventfd()");
+    return -1;
+  }
+  return 0;
+}
+
+void read_lookups(void) {
+  unsigned int c, head, tail;
+  int fresh = 0;
+  unsigned long long n;
+  char *cp;
+  lookup *lp;
+  batch *b, *next;
+  target *tp;
+  ring *rg;
+
+  if ((read(lookupfd, &n, sizeof(n)) == -1) && (errno != EAGAIN)) perror("read(eventfd)");
+  for (c = 0; starting && (c < RESOLVERS); c++) {	// names that came in for the startup batch
+    rg = &starting->done[c];
+    for (head = rg->head, tail = ring_avail(rg); head != tail; head++) {
+      starting->jobs[*(int *)(rg->recs+(head%RINGSIZE)*sizeof(int))].pending = 0;
+      __atomic_store_n(&rg->head, head+1, __ATOMIC_RELEASE);
+      fresh = 1;
+    }
+  }
+  pthread_mutex_lock(&lookuplock);
+  lp = lookupsdone;
+  lookupsdone = NULL;
+  b = batchesdone;	// their lookups are all in the list above, or were in an earlier one
+  batchesdone = NULL;
+  pthread_mutex_unlock(&lookuplock);
+
+  for (; lp; lp = lp->next) {
+    for (c = sockaddr_hash(&lp->addr)&addrmask; (tp = addrhash[c]); c = (c+1)&addrmask) {	// every host with this address
+      if (!sockaddr_equal(tp->addr, &lp->addr)) continue;
+      strcpy(tp->name, lp->name);
+      if (tp->labels && (cp = metric_labels(tp))) {
+        free(tp->labels);
+        tp->labels = cp;
+      }
+      if (logfd != -1) log_target(tp);
+      if (tp == showinfo) update_screen('i');
+    }
+  }
+  if (showdown && ndown) update_screen('d');
+
+  for (; b; b = next) {
+    next = b->nextdone;
+    for (c = 0; c < b->n; c++) b->jobs[c].pending = 0;	// what the rings didn't bring
+    if (b == starting) {
+      timer_del(&mergetimer);
+      if (merge_targets(b) == -1) exit(-3);
+      starting = NULL;
+      drop_oldhist();
+      fresh = 0;
+    }
+    if (b == reloading) {
+      reloading = NULL;
+      if (merge_targets(b) == -1) exit(-3);
+    }
+    if (!reloading && !starting && reloadagain) {
+      reloadagain = 0;
+      gotreload = 1;
+    }
+    free_batch(b);
+  }
+  if (!fresh) return;
+  if (!hist) {	// before the start
+    if (merge_targets(starting) == -1) exit(-3);
+  }
+  else if (!mergetimer.next) timer_add(&timers, &mergetimer, timers.now+RESOLVEMERGE);
+}
+
+void merge_resolved(timer *tm) {	// the callback of mergetimer
+  if (starting && (merge_targets(starting) == -1)) exit(-3);
+}
+
+void layout_tree(void) {	// each host hangs off the nearest previous one with a lower rank, O(n)
+  int row = 1;
+  target *tp, *prev = NULL, *p;
+
+  for (tp = targets; tp; prev = tp, tp = tp->next) {
+    if (tp->detached && prev) row++;	// blank line in between
+    tp->treey = row++;
+    tp->treex = 2*tp->rank+2;
+    for (p = prev; p && (p->rank >= tp->rank); p = p->parent);
+    tp->parent = p;
+    tp->lastkid = NULL;
+    if (!p) continue;
+    tp->treeline = (p->lastkid?p->lastkid->treey:p->treey)+1;
+    p->lastkid = tp;
+  }
+}
+
+void aggregate(target *tp) {	// brings the subtree sums of tp and its ancestors in line with its current state
+  subtree now, d;
+  target *p;
+
+  now.hosts = 1;
+  now.down = tp->st->treecolor == STATE_LOSS;
+  now.losing = tp->st->lastcolor == STATE_LOSS;
+  now.replied = tp->st->rttmin != UINT_MAX;
+  now.excess = now.replied?(long)tp->st->rttlast - tp->st->rttmin:0;
+  d.hosts = now.hosts - tp->own.hosts;
+  d.down = now.down - tp->own.down;
+  d.losing = now.losing - tp->own.losing;
+  d.replied = now.replied - tp->own.replied;
+  d.excess = now.excess - tp->own.excess;
+  if (!d.hosts && !d.down && !d.losing && !d.replied && !d.excess) return;
+  tp->own = now;
+  for (p = tp; p; p = p->parent) {	// unsigned wraparound takes care of the decrements
+    p->sub.hosts += d.hosts;
+    p->sub.down += d.down;
+    p->sub.losing += d.losing;
+    p->sub.replied += d.replied;
+    p->sub.excess += d.excess;
+  }
+  all.hosts += d.hosts;
+  all.down += d.down;
+  all.losing += d.losing;
+  all.replied += d.replied;
+  all.excess += d.excess;
+}
+
+void rebuild_aggregates(void) {	// after the tree changed shape
+  target *tp;
+
+  memset(&all, 0, sizeof(all));
+  for (tp = targets; tp; tp = tp->next) {
+    memset(&tp->own, 0, sizeof(subtree));
+    memset(&tp->sub, 0, sizeof(subtree));
+  }
+  for (tp = targets; tp; tp = tp->next) aggregate(tp);
+}
+
+target *down_above(target *tp) {	// the nearest ancestor that is down, if any
+  for (tp = tp->parent; tp; tp = tp->parent) {
+    if (tp->own.down) return tp;
+  }
+  return NULL;
+}
+
+size_t history_size(unsigned int capacity) {
+  return sizeof(histheader) + capacity*sizeof(statedata) + HISTLOG*capacity*sizeof(pingdata);
+}
+
+void init_state(statedata *sd, target *t) {
+  memset(sd, 0, sizeof(statedata));
+  strcpy(sd->ipstr, t->ipstr);
+  sd->rttmin = -1;
+  sd->lastcolor = 99;
+}
+
+int open_history(void) {	// memory mapped, so a restart carries on; known hosts are carried over by address
+  int c, fd, oldfd, *index = NULL;
+  unsigned int i, mask = 0;
+  statedata *states, *oldstates = NULL;
+  pingdata *pings, *oldpings = NULL;
+  histheader *old = NULL;
+  size_t oldsize = 0;
+  struct stat sb;
+  target *tp;
+
+  if ((oldfd = open(HISTFILE, O_RDWR|O_CREAT, 0644)) == -1) {
+    perror("open("HISTFILE")");
+    return -1;
+  }
+  if ((fstat(oldfd, &sb) == 0) && (sb.st_size >= sizeof(histheader))) {
+    old = (histheader *)mmap(NULL, sb.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, oldfd, 0);
+    if (old == MAP_FAILED) old = NULL;
+    else if (memcmp(old->magic, HISTMAGIC, 8) || (old->version != HISTVERSION) || (old->histlog != HISTLOG)
+          || (old->statesize != sizeof(statedata)) || (old->pingsize != sizeof(pingdata))
+          || (sb.st_size < history_size(old->capacity))) {
+      announce("Ignoring incompatible %s", HISTFILE);
+      munmap(old, sb.st_size);
+      old = NULL;
+    }
+    else {
+      oldsize = sb.st_size;
+      oldstates = (statedata *)(old+1);
+      oldpings = (pingdata *)(oldstates+old->capacity);
+    }
+  }
+
+  if (old && (old->ntargets == ntargets)) {	// Same hosts in the same order: use it as it is
+    for (tp = targets; tp; tp = tp->next) {
+      if (strcmp(oldstates[tp->num].ipstr, tp->ipstr)) break;
+    }
+    if (!tp) {
+      hist = old;
+      histsize = oldsize;
+      fd = oldfd;
+      old = NULL;
+    }
+  }
+
+  if (!hist) {
+    if ((fd = open(HISTFILE".new", O_RDWR|O_CREAT|O_TRUNC, 0644)) == -1) {
+      perror("open("HISTFILE".new)");
+      return -1;
+    }
+    histsize = history_size(ntargets+ntargets/4+16);	// leave some room
+    if (ftruncate(fd, histsize) == -1) {
+      perror("ftruncate()");
+      return -1;
+    }
+    if ((hist = (histheader *)mmap(NULL, histsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+      perror("mmap()");
+      return -1;
+    }
+    memcpy(hist->magic, HISTMAGIC, 8);
+    hist->version = HISTVERSION;
+    hist->histlog = HISTLOG;
+    hist->statesize = sizeof(statedata);
+    hist->pingsize = sizeof(pingdata);
+    hist->capacity = ntargets+ntargets/4+16;
+    hist->ntargets = ntargets;
+    states = (statedata *)(hist+1);
+    pings = (pingdata *)(states+hist->capacity);
+
+    if (old) {	// Index the old records by address to carry them over
+      hist->currlog = old->currlog;
+      hist->pinground = old->pinground;
+      memcpy(hist->passtime, old->passtime, sizeof(hist->passtime));
+      for (mask = 16; mask < 2*old->ntargets; mask <<= 1);
+      if (!(index = (int *)malloc(sizeof(int)*mask--))) {
+        perror("malloc()");
+        return -1;
+      }
+      memset(index, -1, sizeof(int)*(mask+1));
+      for (i = 0; i < old->ntargets; i++) {
+        for (c = fnv_hash(oldstates[i].ipstr, strlen(oldstates[i].ipstr))&mask; index[c] != -1; c = (c+1)&mask);
+        index[c] = i;
+      }
+    }
+    for (tp = targets; tp; tp = tp->next) {
+      if (old) {
+        for (c = fnv_hash(tp->ipstr, strlen(tp->ipstr))&mask; index[c] != -1; c = (c+1)&mask) {
+          if ((index[c] != -2) && !strcmp(oldstates[index[c]].ipstr, tp->ipstr)) break;
+        }
+        if (index[c] >= 0) {
+          memcpy(&states[tp->num], &oldstates[index[c]], sizeof(statedata));
+          for (i = 0; i < HISTLOG; i++) pings[i*hist->capacity+tp->num] = oldpings[i*old->capacity+index[c]];
+          index[c] = -2;	// used; a host listed twice gets the next record with its address
+          continue;
+        }
+      }
+      init_state(&states[tp->num], tp);
+    }
+
+    if (old && starting) {	// the hosts whose names are still coming in find their records in it
+      oldhist = old;
+      oldhistsize = oldsize;
+      oldindex = index;
+      oldmask = mask;
+    }
+    else if (old) {
+      free(index);
+      munmap(old, oldsize);
+    }
+    if (rename(HISTFILE".new", HISTFILE) == -1) {
+      perror("rename()");
+      return -1;
+    }
+  }
+  close(oldfd);
+  if (fd != oldfd) close(fd);
+
+  states = (statedata *)(hist+1);
+  pings = (pingdata *)(states+hist->capacity);
+  if (!(histlog = (passdata *)malloc(sizeof(passdata)*HISTLOG))) {
+    perror("malloc()");
+    return -1;
+  }
+  for (c = 0; c < HISTLOG; c++) histlog[c].data = pings+c*hist->capacity;
+  currlog = hist->currlog;
+  pinground = hist->pinground;
+
+  for (tp = targets; tp; tp = tp->next) {
+    tp->st = &states[tp->num];
+    if (tp->st->treecolor == STATE_LOSS) ndown++;
+  }
+  for (c = 1; c <= HISTLOG; c++) {	// Rebuild the window aggregates, oldest pass first
+    for (tp = targets; tp; tp = tp->next) {
+      if (histlog[(currlog+c)%HISTLOG].data[tp->num].color) window_add(tp, (currlog+c)%HISTLOG, pinground-HISTLOG+c);
+    }
+  }
+  rebuild_aggregates();
+
+  if (pinground) announce("History resumed from %s at ping round %d (%lu bytes)", HISTFILE, pinground, histsize);
+  else announce("History started in %s (%lu bytes)", HISTFILE, histsize);
+  return 0;
+}
+
+int open_log(char *filename) {	// LOGMAGIC, then the records in the REC_ defines
+  struct stat sb;
+  struct timespec now;
+  target *tp;
+
+  if ((logfd = open(filename, O_WRONLY|O_APPEND|O_CREAT, 0644)) == -1) {
+    perror("open()");
+    return -1;
+  }
+  if ((fstat(logfd, &sb) == 0) && !sb.st_size) {
+    memcpy(logbuf, LOGMAGIC, 8);
+    loglen = 8;
+  }
+  clock_gettime(CLOCK_REALTIME, &now);
+  loglast = now.tv_sec*1000000LL + now.tv_nsec/1000;
+  logbuf[loglen++] = REC_SESSION;
+  log_varint(loglast);
+  for (tp = targets; tp; tp = tp->next) log_target(tp);
+  flush_log(NULL);
+  announce("Logging results to %s", filename);
+  return 0;
+}
+
+void log_target(target *tp) {	// also used to rename a host, for --analyze the last name counts
+  if (loglen > LOGBUFSIZE-256) flush_log(NULL);
+  logbuf[loglen++] = REC_TARGET;
+  log_varint(tp->num);
+  log_string(tp->ipstr);
+  log_string(tp->name);
+}
+
+void log_varint(unsigned long long v) {
+  while (v > 0x7f) {
+    logbuf[loglen++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  logbuf[loglen++] = v;
+}
+
+void log_string(char *str) {
+  int len = strlen(str);
+
+  log_varint(len);
+  memcpy(&logbuf[loglen], str, len);
+  loglen += len;
+}
+
+void log_probe(target *tp, struct timespec *when, unsigned int rtt, int color) {
+  long long t = when->tv_sec*1000000LL + when->tv_nsec/1000, delta = t-loglast;
+
+  if (loglen > LOGBUFSIZE-32) flush_log(NULL);
+  logbuf[loglen++] = color;
+  log_varint((delta << 1) ^ (delta >> 63));	// zigzag, results don't come in in send order
+  log_varint(tp->num);
+  if (color != STATE_LOSS) log_varint(rtt);
+  loglast = t;
+}
+
+void flush_log(timer *tm) {	// also the callback of logtimer
+  int r, done = 0;
+
+  while (done < loglen) {
+    if ((r = write(logfd, &logbuf[done], loglen-done)) == -1) {
+      if (errno == EINTR) continue;
+      perror("write()");
+      break;
+    }
+    done += r;
+  }
+  loglen = 0;
+  if (tm) timer_add(&timers, tm, tm->expires+LOGFLUSH);
+}
+
+int get_varint(unsigned char **p, unsigned char *end, unsigned long long *v) {
+  int shift = 0;
+
+  *v = 0;
+  while (*p < end) {
+    *v |= (unsigned long long)(**p & 0x7f) << shift;
+    if (!(*(*p)++ & 0x80)) return 0;
+    if ((shift += 7) > 63) return -1;
+  }
+  return -1;
+}
+
+typedef struct loghost {
+  char ipstr[INET6_ADDRSTRLEN+1];
+  char name[HOSTLEN+1];
+  unsigned long count, losscount, delaycount, jitcount, latecount;
+  unsigned long long rttsum;
+  unsigned int rttmin, rttmax;
+  unsigned int lossrun, outages;
+  long long downsince, downtime;
+  sketch quant;
+} loghost;
+
+char *logtime(long long us) {
+  static char buf[2][20];
+  static int n = 0;
+  time_t t = us/1000000;
+
+  strftime(buf[++n%2], 20, "%Y-%m-%d %H:%M:%S", localtime(&t));
+  return buf[n%2];
+}
+
+int analyze_log(char *filename) {	// outages as they're found, statistics per address at the end
+  int fd, c, type, nhosts = 0, maxhosts = 0, nmap = 0, *hostidx = NULL, *nummap = NULL;
+  unsigned int i, mask = 0;
+  unsigned long long v, num, len;
+  long long t = 0, delta;
+  char ipstr[INET6_ADDRSTRLEN+1], name[HOSTLEN+1];
+  unsigned char *map, *p, *end;
+  struct stat sb;
+  loghost *hosts = NULL, *h;
+
+  if ((fd = open(filename, O_RDONLY)) == -1) {
+    perror("open()");
+    return -1;
+  }
+  if ((fstat(fd, &sb) == -1) || (sb.st_size < 8)) {
+    fprintf(stderr, "%s is not a pinger results log\n", filename);
+    return -1;
+  }
+  if ((map = (unsigned char *)mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    perror("mmap()");
+    return -1;
+  }
+  madvise(map, sb.st_size, MADV_SEQUENTIAL);
+  if (memcmp(map, LOGMAGIC, 8)) {
+    fprintf(stderr, "%s is not a pinger results log\n", filename);
+    return -1;
+  }
+
+  printf("Outages (two or more consecutive probes lost):\n");
+  for (p = map+8, end = map+sb.st_size; p < end;) {
+    type = *p++;
+    if (type == REC_SESSION) {
+      if (get_varint(&p, end, &v)) break;
+      t = v;
+      nmap = 0;
+    }
+    else if (type == REC_TARGET) {
+      if (get_varint(&p, end, &num) || get_varint(&p, end, &len) || (len > INET6_ADDRSTRLEN) || (p+len > end)) break;
+      memcpy(ipstr, p, len);
+      ipstr[len] = '\0';
+      p += len;
+      if (get_varint(&p, end, &len) || (len > HOSTLEN) || (p+len > end)) break;
+      memcpy(name, p, len);
+      name[len] = '\0';
+      p += len;
+
+      if (2*nhosts >= mask) {	// grow the address index
+        for (mask = 16; mask < 4*(nhosts+1); mask <<= 1);
+        if (!(hostidx = (int *)realloc(hostidx, sizeof(int)*mask--))) {
+          perror("realloc()");
+          return -1;
+        }
+        memset(hostidx, -1, sizeof(int)*(mask+1));
+        for (c = 0; c < nhosts; c++) {
+          for (i = fnv_hash(hosts[c].ipstr, strlen(hosts[c].ipstr))&mask; hostidx[i] != -1; i = (i+1)&mask);
+          hostidx[i] = c;
+        }
+      }
+      for (i = fnv_hash(ipstr, strlen(ipstr))&mask; hostidx[i] != -1; i = (i+1)&mask) {
+        if (!strcmp(hosts[hostidx[i]].ipstr, ipstr)) break;
+      }
+      if (hostidx[i] == -1) {
+        if (nhosts == maxhosts) {
+          maxhosts = maxhosts?2*maxhosts:64;
+          if (!(hosts = (loghost *)realloc(hosts, sizeof(loghost)*maxhosts))) {
+            perror("realloc()");
+            return -1;
+          }
+        }
+        h = &hosts[nhosts];
+        memset(h, 0, sizeof(loghost));
+        strcpy(h->ipstr, ipstr);
+        h->rttmin = -1;
+        hostidx[i] = nhosts++;
+      }
+      strcpy(hosts[hostidx[i]].name, name);
+      if (num >= nmap) {
+        if (!(nummap = (int *)realloc(nummap, sizeof(int)*(num+64)))) {
+          perror("realloc()");
+          return -1;
+        }
+        for (; nmap < num+64; nmap++) nummap[nmap] = -1;
+      }
+      nummap[num] = hostidx[i];
+    }
+    else if (((type >= STATE_OK) && (type <= STATE_LOSS)) || (type == REC_LATE)) {
+      if (get_varint(&p, end, &v) || get_varint(&p, end, &num)) break;
+      delta = (v >> 1) ^ -(long long)(v & 1);
+      t += delta;
+      if ((type != STATE_LOSS) && get_varint(&p, end, &v)) break;
+      if ((num >= nmap) || (nummap[num] == -1)) continue;
+      h = &hosts[nummap[num]];
+      if (type == REC_LATE) {	// not an answer in time, so it doesn't end an outage
+        h->latecount++;
+        h->rttsum += v;
+        if (v < h->rttmin) h->rttmin = v;
+        if (v > h->rttmax) h->rttmax = v;
+        sketch_add(&h->quant, v);
+        continue;
+      }
+      h->count++;
+      if (type == STATE_LOSS) {
+        h->losscount++;
+        if (!h->lossrun++) h->downsince = t;
+        continue;
+      }
+      if (h->lossrun >= 2) {
+        printf("  %s - %s %8s  %s (%s)\n", logtime(h->downsince), logtime(t), itodur((t-h->downsince)/1000000), h->name, h->ipstr);
+        h->outages++;
+        h->downtime += t-h->downsince;
+      }
+      h->lossrun = 0;
+      if (type == STATE_LAG) h->delaycount++;
+      else if (type == STATE_JIT) h->jitcount++;
+      h->rttsum += v;
+      if (v < h->rttmin) h->rttmin = v;
+      if (v > h->rttmax) h->rttmax = v;
+      sketch_add(&h->quant, v);
+    }
+    else break;
+  }
+  if (p < end) fprintf(stderr, "Stopped at a damaged or incomplete record at offset %ld\n", (long)(p-map));
+  for (c = 0; c < nhosts; c++) {
+    h = &hosts[c];
+    if (h->lossrun < 2) continue;
+    printf("  %s - ongoing             %8s  %s (%s)\n", logtime(h->downsince), itodur((t-h->downsince)/1000000), h->name, h->ipstr);
+    h->outages++;
+    h->downtime += t-h->downsince;
+  }
+
+  printf("\n%-30s %-16s %8s %6s %6s %6s %6s %7s %7s %7s %7s %7s %4s %8s\n", "Host", "Address", "Probes", "Lost", "Late", "Jitter", "Delay",
+    "Min", "Avg", "p50", "p99", "Max", "Down", "Downtime");
+  for (c = 0; c < nhosts; c++) {
+    h = &hosts[c];
+    printf("%-30.30s %-16s %8lu %5.1f%% %5.1f%% %5.1f%% %5.1f%% %7s %7s %7s %7s %7s %4u %8s\n", h->name, h->ipstr, h->count,
+      h->count?h->losscount*100.0/h->count:0.0, h->count?h->latecount*100.0/h->count:0.0,
+      h->count?h->jitcount*100.0/h->count:0.0, h->count?h->delaycount*100.0/h->count:0.0,
+      ustoms(h->rttmin), h->count+h->latecount>h->losscount?ustoms(h->rttsum/(h->count-h->losscount+h->latecount)):"-",
+      ustoms(sketch_quantile(&h->quant, 0.5, h->rttmin, h->rttmax)), ustoms(sketch_quantile(&h->quant, 0.99, h->rttmin, h->rttmax)), h->rttmax?ustoms(h->rttmax):"-",
+      h->outages, itodur(h->downtime/1000000));
+  }
+  return 0;
+}
+
+int open_metrics(char *arg) {	// a localhost port or a unix socket, serving the latest snapshot
+  int c, one = 1;
+  char *end;
+  long port;
+  target *tp;
+  struct sockaddr_in sin;
+  struct sockaddr_un sun;
+
+  port = strtol(arg, &end, 10);
+  if (!*end && (port > 0) && (port < 65536)) {
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((metricsfd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) == -1) {
+      perror("socket()");
+      return -1;
+    }
+    setsockopt(metricsfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(metricsfd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+      perror("bind()");
+      return -1;
+    }
+    announce("Serving metrics on http://127.0.0.1:%ld/metrics", port);
+  }
+  else {
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(arg) >= sizeof(sun.sun_path)) {
+      fprintf(stderr, "Metrics socket path too long: %s\n", arg);
+      return -1;
+    }
+    strcpy(sun.sun_path, arg);
+    if ((metricsfd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) == -1) {
+      perror("socket()");
+      return -1;
+    }
+    unlink(arg);	// left behind by an earlier run
+    if (bind(metricsfd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+      perror("bind()");
+      return -1;
+    }
+    metricspath = arg;
+    announce("Serving metrics on unix socket %s", arg);
+  }
+  if (listen(metricsfd, MAXCLIENTS) == -1) {
+    perror("listen()");
+    return -1;
+  }
+  for (c = 0; c < MAXCLIENTS; c++) {
+    clients[c].fd = -1;
+    clients[c].timer.func = client_timeout;
+  }
+  for (tp = targets; tp; tp = tp->next) {
+    if (!(tp->labels = metric_labels(tp))) return -1;
+  }
+  return 0;
+}
+
+char *metric_labels(target *tp) {	// host="name",address="ip",id="X" with the quotes escaped
+  int n;
+  char *cp, buf[2*HOSTLEN+INET6_ADDRSTRLEN+40];
+
+  n = sprintf(buf, "host=\"");
+  for (cp = tp->name; *cp; cp++) {
+    if ((*cp == '"') || (*cp == '\\')) buf[n++] = '\\';
+    buf[n++] = *cp;
+  }
+  n += sprintf(&buf[n], "\",address=\"%s\",id=\"%s\"", tp->ipstr, tp->id);
+  if (!(cp = (char *)malloc(n+1))) {
+    perror("malloc()");
+    return NULL;
+  }
+  strcpy(cp, buf);
+  return cp;
+}
+
+snapshot *new_snapshot(size_t size) {
+  snapshot *sn;
+
+  if (!(sn = (snapshot *)malloc(sizeof(snapshot))) || !(sn->text = (char *)malloc(size))) {
+    perror("malloc()");
+    free(sn);
+    return NULL;
+  }
+  sn->refs = 1;
+  sn->failed = 0;
+  sn->len = 0;
+  sn->size = size;
+  return sn;
+}
+
+void metric_printf(snapshot *sn, char *fmt, ...) {
+  int r;
+  char *tmp;
+  va_list arglist;
+
+  while (!sn->failed) {
+    va_start(arglist, fmt);
+    r = vsnprintf(sn->text+sn->len, sn->size-sn->len, fmt, arglist);
+    va_end(arglist);
+    if (sn->len+r < sn->size) {
+      sn->len += r;
+      return;
+    }
+    if (!(tmp = (char *)realloc(sn->text, 2*sn->size))) {
+      perror("realloc()");
+      sn->failed = 1;
+      return;
+    }
+    sn->text = tmp;
+    sn->size *= 2;
   }
-  return r;
 }
 
-struct timeval tvadd(struct timeval left, struct timeval right) {
-  struct timeval r;
-
-  r.tv_sec = left.tv_sec + right.tv_sec;
-  r.tv_usec = left.tv_usec + right.tv_usec;
-  if (r.tv_usec > 1000000) {
-    r.tv_sec++;
-    r.tv_usec -= 1000000;
+void metric_append(snapshot *sn, snapshot *part) {
+  size_t size = sn->size;
+  char *tmp;
+
+  if (part->failed) sn->failed = 1;
+  if (sn->failed) return;
+  while (sn->len+part->len >= size) size *= 2;
+  if (size != sn->size) {
+    if (!(tmp = (char *)realloc(sn->text, size))) {
+      perror("realloc()");
+      sn->failed = 1;
+      return;
+    }
+    sn->text = tmp;
+    sn->size = size;
   }
-
-  return r;
+  memcpy(sn->text+sn->len, part->text, part->len);
+  sn->len += part->len;
 }
 
-void read_socket(int sock) {
-  char packet[MAXPACKET];
-  struct sockaddr_storage from;
-  int r = 0, len = sizeof(packet), fromlen = sizeof(from);
-
-  r = recvfrom(sock, packet, len, 0, (struct sockaddr *)&from, &fromlen);
+static struct {
+  char *name, *type, *help;
+} families[] = {
+  { "pinger_probes_total", "counter", "Probes sent to the host" },
+  { "pinger_probes_lost_total", "counter", "Probes that timed out" },
+  { "pinger_probes_delayed_total", "counter", "Replies classified as delayed" },
+  { "pinger_probes_ok_total", "counter", "Replies within the jitter margin of the baseline" },
+  { "pinger_rtt_min_seconds", "gauge", "Fastest reply" },
+  { "pinger_rtt_max_seconds", "gauge", "Slowest reply" },
+  { "pinger_rtt_last_seconds", "gauge", "Round trip time of the latest reply" },
+  { "pinger_baseline_seconds", "gauge", "Average round trip time of the replies classified as ok" },
+  { "pinger_down", "gauge", "1 if the host failed to reply to two or more consecutive probes" },
+  { "pinger_down_since_timestamp_seconds", "gauge", "When a host that is down stopped replying" },
+  { "pinger_window_probes", "gauge", "Probe results in the window" },
+  { "pinger_window_probes_lost", "gauge", "Probes lost in the window" },
+  { "pinger_window_probes_delayed", "gauge", "Replies classified as delayed in the window" },
+  { "pinger_window_rtt_min_seconds", "gauge", "Fastest reply in the window" },
+  { "pinger_window_rtt_avg_seconds", "gauge", "Average round trip time in the window" },
+  { "pinger_window_rtt_max_seconds", "gauge", "Slowest reply in the window" },
+  { "pinger_window_rtt_stddev_seconds", "gauge", "Standard deviation of the round trip time in the window" },
+  { "pinger_window_baseline_seconds", "gauge", "Average round trip time of the ok replies in the window" },
+  { "pinger_timeout_seconds", "gauge", "How long the host's next probe waits for a reply" },
+  { "pinger_train_packets_total", "counter", "Echoes sent in packet trains" },
+  { "pinger_train_lost_total", "counter", "Echoes in packet trains that got no reply" },
+  { "pinger_train_jitter_seconds", "gauge", "Interarrival jitter within the packet trains (RFC 3550)" },
+  { "pinger_replies_late_total", "counter", "Replies that came after their probe had timed out" },
+  { "pinger_replies_duplicate_total", "counter", "Extra replies to a probe that was answered already" },
+  { "pinger_replies_reordered_total", "counter", "Replies that came after the reply to a later probe" },
+  { "pinger_baseline_deviation_seconds", "gauge", "Mean deviation of the ok replies from the baseline" },
+  { "pinger_rebaselines_total", "counter", "Lasting level shifts after which the baseline was moved" },
+  { "pinger_subtree_down", "gauge", "Hosts down behind this host in the network tree" },
+  { "pinger_subtree_losing", "gauge", "Hosts behind this host in the network tree whose latest probe was lost" },
+  { "pinger_subtree_latency_excess_seconds", "gauge", "Average latest round trip time above the fastest one of the hosts behind this host" }
+};
+
+static double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+static snapshot *parts[sizeof(families)/sizeof(families[0])+3];	// a text per family while a snapshot is built, then the summaries
+static target *nextmetric;	// the next host to add to them
+static unsigned int partsgen;	// targetsgen when they were started
+
+int metric_value(target *tp, logdata *ld, int family, double *v) {	// returns 0 when the host has no such value (yet)
+  switch (family) {
+    case 0:  *v = tp->st->probecount;
+             return 1;
+    case 1:  *v = tp->st->losscount;
+             return 1;
+    case 2:  *v = tp->st->delaycount;
+             return 1;
+    case 3:  *v = tp->st->okcount;
+             return 1;
+    case 4:  *v = tp->st->rttmin/1e6;
+             return tp->st->rttmin != UINT_MAX;
+    case 5:  *v = tp->st->rttmax/1e6;
+             return tp->st->rttmin != UINT_MAX;
+    case 6:  *v = tp->st->rttlast/1e6;
+             return tp->st->rttmin != UINT_MAX;
+    case 7:  *v = tp->st->okavg/1e6;
+             return tp->st->okcount != 0;
+    case 8:  *v = tp->st->treecolor == STATE_LOSS;
+             return 1;
+    case 9:  *v = tp->st->downsince;
+             return tp->st->treecolor == STATE_LOSS;
+    case 18: *v = (tp->st->rto?tp->st->rto:rtomax*1000)/1e6;
+             return 1;
+    case 19: *v = tp->train?tp->train->packets:0;
+             return tp->train != NULL;
+    case 20: *v = tp->train?tp->train->lost:0;
+             return tp->train != NULL;
+    case 21: *v = tp->train?tp->train->jitter/1e6:0;
+             return tp->train && tp->train->trains;
+    case 22: *v = tp->st->latecount;
+             return 1;
+    case 23: *v = tp->st->dupcount;
+             return 1;
+    case 24: *v = tp->st->reordercount;
+             return 1;
+    case 25: *v = tp->st->okdev/1e6;
+             return tp->st->okcount != 0;
+    case 26: *v = tp->st->rebaselines;
+             return 1;
+    case 27: *v = tp->sub.down-tp->own.down;
+             return tp->lastkid != NULL;
+    case 28: *v = tp->sub.losing-tp->own.losing;
+             return tp->lastkid != NULL;
+    case 29: *v = tp->sub.replied-tp->own.replied?(double)(tp->sub.excess-tp->own.excess)/(tp->sub.replied-tp->own.replied)/1e6:0;
+             return tp->sub.replied != tp->own.replied;
+  }
+  switch (family) {
+    case 10: *v = ld->count;
+             return 1;
+    case 11: *v = ld->losscount;
+             return 1;
+    case 12: *v = ld->delaycount;
+             return 1;
+    case 13: *v = ld->rttmin/1e6;
+             return ld->rttmin != UINT_MAX;
+    case 14: *v = ld->rttavg/1e6;
+             return ld->rttmin != UINT_MAX;
+    case 15: *v = ld->rttmax/1e6;
+             return ld->rttmin != UINT_MAX;
+    case 16: *v = ld->stddev/1e6;
+             return ld->rttmin != UINT_MAX;
+    case 17: *v = ld->okavg/1e6;
+             return tp->win.okcount != 0;
+  }
+  return 0;
+}
 
-  if (r > 0) print_packet(packet, r, &from);
+void start_parts(void) {
+  int c, n = sizeof(families)/sizeof(families[0]);
 
-  if ((r == -1) && (errno != EINTR)) perror("recvfrom()");
+  for (c = 0; c < sizeof(parts)/sizeof(parts[0]); c++) parts[c]->len = 0;
+  for (c = 0; c < n; c++) {
+    metric_printf(parts[c], "# HELP %s %s\n# TYPE %s %s\n", families[c].name, families[c].help, families[c].name, families[c].type);
+  }
+  metric_printf(parts[n], "# HELP pinger_rtt_seconds Round trip times of all replies\n# TYPE pinger_rtt_seconds summary\n");
+  metric_printf(parts[n+1], "# HELP pinger_window_rtt_seconds Round trip time quantiles in the window, by q\n# TYPE pinger_window_rtt_seconds gauge\n");
+  metric_printf(parts[n+2], "# HELP pinger_train_rtt_seconds Smoothed round trip time of the packet train echoes of each payload size\n# TYPE pinger_train_rtt_seconds gauge\n");
 }
 
-int sockaddr_equal(struct sockaddr_storage *a, struct sockaddr_storage *b) {
-  if (a->ss_family != b->ss_family) return 0;
+void add_metrics(target *tp) {	// a host's lines go to the end of each part
+  int c, q, n = sizeof(families)/sizeof(families[0]);
+  unsigned int qv[sizeof(quantiles)/sizeof(quantiles[0])];
+  double v;
+  logdata *ld = get_logdata(tp);	// once for all of the pinger_window_ families
 
-  switch (a->ss_family) {
-    case AF_INET:
-    {
-      struct sockaddr_in *a4 = (struct sockaddr_in *) a;
-      struct sockaddr_in *b4 = (struct sockaddr_in *) b;
-      return a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+  for (c = 0; c < n; c++) {
+    if (metric_value(tp, ld, c, &v)) metric_printf(parts[c], "%s{%s} %.15g\n", families[c].name, tp->labels, v);
+  }
+  if (tp->st->quant.total) {
+    sketch_quantiles(&tp->st->quant, quantiles, sizeof(quantiles)/sizeof(quantiles[0]), qv, tp->st->rttmin, tp->st->rttmax);
+    for (q = 0; q < sizeof(quantiles)/sizeof(quantiles[0]); q++) {
+      metric_printf(parts[n], "pinger_rtt_seconds{%s,quantile=\"%g\"} %.6f\n", tp->labels, quantiles[q], qv[q]/1e6);
     }
-    case AF_INET6:
-    {
-      struct sockaddr_in6 *a6 = (struct sockaddr_in6 *) a;
-      struct sockaddr_in6 *b6 = (struct sockaddr_in6 *) b;
-      return memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+  }
+  metric_printf(parts[n], "pinger_rtt_seconds_sum{%s} %.6f\npinger_rtt_seconds_count{%s} %u\n", tp->labels, tp->st->rttsum/1e6, tp->labels, tp->st->quant.total);
+  if (tp->win.quant.total) {
+    sketch_quantiles(&tp->win.quant, quantiles, sizeof(quantiles)/sizeof(quantiles[0]), qv, ld->rttmin, ld->rttmax);
+    for (q = 0; q < sizeof(quantiles)/sizeof(quantiles[0]); q++) {
+      metric_printf(parts[n+1], "pinger_window_rtt_seconds{%s,q=\"%g\"} %.6f\n", tp->labels, quantiles[q], qv[q]/1e6);
+    }
+  }
+  if (tp->train) {
+    for (q = 0; q < tp->train->nsizes; q++) {
+      if (tp->train->sizertt[q]) metric_printf(parts[n+2], "pinger_train_rtt_seconds{%s,size=\"%u\"} %.6f\n", tp->labels, tp->train->sizes[q], tp->train->sizertt[q]/1e6);
     }
-    default:
-      exit(-1);
   }
 }
 
-const char *sockaddr_print(struct sockaddr_storage *sas) {
-  static char buf[INET6_ADDRSTRLEN];
-  void *addr = (sas->ss_family==AF_INET?(void *)&((struct sockaddr_in *)sas)->sin_addr:(void *)&((struct sockaddr_in6 *)sas)->sin6_addr);
-  return inet_ntop(sas->ss_family, addr, buf, INET6_ADDRSTRLEN);
-}
-
-void print_packet(char *packet, int len, struct sockaddr_storage *from) {
-  int r, ampl, seq;
-  long *lp = (long *)packet;
-  target *tp;
-  struct timeval *packtv, currtv;
-
-  if (from->ss_family == AF_INET) {
-    struct ip *ip = (struct ip *)packet;
-    int hlen = ip->ip_hl << 2;
-    len -= hlen;
-    // if (len < hlen + ICMP_MINLEN) return;
-    struct icmp *icp = (struct icmp *)(packet + hlen);
-    if (ntohs(icp->icmp_id) != pid) return;
-    seq = ntohs(icp->icmp_seq);
-    if ((icp->icmp_type != 0) || (icp->icmp_code != 0)) return;
-    packtv = (struct timeval *)icp->icmp_data;
-  }
-  else {
-    struct icmp6_hdr *icp = (struct icmp6_hdr *)packet;
-    // print_scroll("IPv6 packet from %s with type %d / code %d / id %d / seq %d", sockaddr_print(from), icp->icmp6_type, icp->icmp6_code, ntohs(icp->icmp6_id), ntohs(icp->icmp6_seq));
-    if (ntohs(icp->icmp6_id) != pid) return;
-    seq = ntohs(icp->icmp6_seq);
-    if ((icp->icmp6_type != ICMP6_ECHO_REPLY) || (icp->icmp6_code != 0)) return;
-    packtv = (struct timeval *)&(icp->icmp6_data16[2]); // skip the id and seq fields which are part of the ICMP6 data
-  }
+void build_metrics(timer *tm) {	// also the callback of metricstimer; adds METRICSCHUNK hosts per call
+  int c;
+  unsigned int n;
+  batchstats rx, tx;
+  static snapshot *sn = NULL;	// the one being built
+  static unsigned long started;
+
+  if (!sn) {
+    started = tm->expires;
+    if (!(sn = new_snapshot(65536))) {
+      timer_add(&timers, tm, started+METRICSREFRESH);
+      return;
+    }
+    for (c = 0; (c < sizeof(parts)/sizeof(parts[0])) && (parts[c] = new_snapshot(4096)); c++);
+    if (c < sizeof(parts)/sizeof(parts[0])) {
+      while (c--) drop_snapshot(parts[c]);
+      drop_snapshot(sn);
+      sn = NULL;
+      timer_add(&timers, tm, started+METRICSREFRESH);
+      return;
+    }
 
-  for (tp = targets; tp; tp = tp->next) {
-    if (sockaddr_equal(tp->addr, (struct sockaddr_storage *)from)) break;
-    // if (!strcmp(tp->addrs[0]->print, inet_ntoa(from->sin_addr))) break;
-  }
-  if (!tp) return;
-
-  gettimeofday(&currtv, NULL);
-  currtv = tvsub(currtv, *packtv);
-  r = currtv.tv_sec * 1000;
-  r += currtv.tv_usec / 1000;
-
-  if ((tp == currtarget) && (seq == tp->waitping)) {
-    tp->waitping = 0;
-    tp->rttlast = r;
-    tp->rttsum += r;
-    tp->rttavg = tp->rttsum / (seq - tp->losscount);
-    tp->sqsum += powf(r,2);
-    if (r < tp->rttmin) tp->rttmin = r;
-    if (r > tp->rttmax) tp->rttmax = r;
-    if (!tp->okcount) tp->okavg = tp->rttavg;
-    ampl = tp->okavg - tp->rttmin;
-    histlog[currlog].data[tp->num].rtt = r;
-
-    waddch(grid, '\b');
-    if (tp->treecolor == STATE_LOSS) {
-      tp->downsince = 0;
-      ndown--;
+    metric_printf(sn, "# HELP pinger_rounds_total Ping rounds started\n# TYPE pinger_rounds_total counter\npinger_rounds_total %d\n", pinground);
+    metric_printf(sn, "# HELP pinger_targets Hosts being monitored\n# TYPE pinger_targets gauge\npinger_targets %d\n", ntargets);
+    metric_printf(sn, "# HELP pinger_targets_down Hosts that are down\n# TYPE pinger_targets_down gauge\npinger_targets_down %d\n", ndown);
+    metric_printf(sn, "# HELP pinger_window_seconds Length of the window the pinger_window_ metrics cover\n# TYPE pinger_window_seconds gauge\npinger_window_seconds %d\n", HISTLOG*interval);
+    metric_printf(sn, "# HELP pinger_syscalls_total Batched send and receive calls\n# TYPE pinger_syscalls_total counter\n");
+    total_batch(&rx, &tx);
+    metric_printf(sn, "pinger_syscalls_total{direction=\"rx\"} %lu\npinger_syscalls_total{direction=\"tx\"} %lu\n", rx.calls, tx.calls);
+    metric_printf(sn, "# HELP pinger_packets_total Packets sent and received in batches\n# TYPE pinger_packets_total counter\n");
+    metric_printf(sn, "pinger_packets_total{direction=\"rx\"} %lu\npinger_packets_total{direction=\"tx\"} %lu\n", rx.packets, tx.packets);
+    metric_printf(sn, "# HELP pinger_queue_depth_max Most replies waiting in the queue from a worker thread\n# TYPE pinger_queue_depth_max gauge\n");
+    for (c = 0; c < nshards; c++) metric_printf(sn, "pinger_queue_depth_max{shard=\"%d\"} %u\n", c, __atomic_load_n(&shards[c].replies.maxdepth, __ATOMIC_RELAXED));
+    metric_printf(sn, "# HELP pinger_queue_depth_avg Average number of replies found in the queue by the main thread\n# TYPE pinger_queue_depth_avg gauge\n");
+    for (c = 0; c < nshards; c++) {
+      metric_printf(sn, "pinger_queue_depth_avg{shard=\"%d\"} %.3f\n", c, shards[c].replies.drains?(double)shards[c].replies.depthsum/shards[c].replies.drains:0.0);
     }
-    if ((pinground <= LEARNROUNDS) || (r <= tp->okavg+JITMULT*(ampl?ampl:1))) {
-      waddch(grid, GRIDMARK|COLOR_PAIR(STATE_OK));
-      wattron(scroller, COLOR_PAIR(STATE_OK));
-      if ((tp->lastcolor >= STATE_OK) && (tp->treecolor != STATE_OK)) {
-        tp->treecolor = STATE_OK;
-        print_tree();
-      }
-      tp->lastcolor = STATE_OK;
-      tp->okcount++;
-      tp->oksum += r;
-      tp->okavg = tp->oksum/tp->okcount;
-      histlog[currlog].data[tp->num].color = STATE_OK;
-    }
-//    else if ((r <= LAGMULT*tp->rttmin) || (r <= LAGMIN)) {
-    else if (r <= tp->okavg+LAGMULT*(ampl?ampl:1)) {
-      waddch(grid, GRIDMARK|COLOR_PAIR(STATE_JIT));
-      wattron(scroller, COLOR_PAIR(STATE_JIT));
-      if ((tp->lastcolor >= STATE_JIT) && (tp->treecolor != STATE_JIT)) {
-        tp->treecolor = STATE_JIT;
-        print_tree();
-      }
-      tp->lastcolor = STATE_JIT;
-      histlog[currlog].data[tp->num].color = STATE_JIT;
+    metric_printf(sn, "# HELP pinger_queue_drops_total Replies and echo requests lost because a queue was full\n# TYPE pinger_queue_drops_total counter\n");
+    for (c = 0; c < nshards; c++) {
+      metric_printf(sn, "pinger_queue_drops_total{shard=\"%d\"} %lu\n", c, __atomic_load_n(&shards[c].replies.drops, __ATOMIC_RELAXED)+shards[c].cmds.drops);
     }
-    else {
-      waddch(grid, GRIDMARK|COLOR_PAIR(STATE_LAG));
-      wattron(scroller, COLOR_PAIR(STATE_LAG));
-      tp->delaycount++;
-      if ((tp->lastcolor >= STATE_LAG) && (tp->treecolor != STATE_LAG)) {
-        tp->treecolor = STATE_LAG;
-        print_tree();
-      }
-      tp->lastcolor = STATE_LAG;
-      histlog[currlog].data[tp->num].color = STATE_LAG;
+    if (kernelfilter) {
+      metric_printf(sn, "# HELP pinger_kernel_filtered_total Estimated foreign ICMP packets the socket filters kept from waking us (ICMP received by the host less what we read)\n# TYPE pinger_kernel_filtered_total counter\n");
+      metric_printf(sn, "pinger_kernel_filtered_total %lu\n", kernel_filtered());
     }
-    update_screen('g');
-    if (tp->beepmode == 1) beep();
+
+    metric_printf(sn, "# HELP pinger_send_lateness_seconds How late the probes went out on their schedule\n# TYPE pinger_send_lateness_seconds histogram\n");
+    for (c = 0, n = 0; c < SKETCHBUCKETS; c++) {	// the sketch's own buckets, the empty ones left out
+      if (!sendlate.count[c]) continue;
+      n += sendlate.count[c];
+      metric_printf(sn, "pinger_send_lateness_seconds_bucket{le=\"%.6f\"} %u\n", sketch_top(c)/1e6, n);
+    }
+    metric_printf(sn, "pinger_send_lateness_seconds_bucket{le=\"+Inf\"} %u\n", sendlate.total);
+    metric_printf(sn, "pinger_send_lateness_seconds_sum %.6f\npinger_send_lateness_seconds_count %u\n", sendlatesum/1e6, sendlate.total);
+    partsgen = targetsgen-1;
+  }
+
+  if (partsgen != targetsgen) {	// hosts came or went, start over on the new list
+    start_parts();
+    nextmetric = targets;
+    partsgen = targetsgen;
   }
-  else if (seq != tp->waitping) {
-    wattron(scroller, COLOR_PAIR(STATE_LOSS));
-    print_scroll("%c  %-40.40s %-40s %5d ms  (out of sync)", currtarget->id, currtarget->name, currtarget->ipstr, r);
+  for (c = 0; nextmetric && (c < METRICSCHUNK); c++, nextmetric = nextmetric->next) add_metrics(nextmetric);
+  if (nextmetric) {
+    timer_add(&timers, tm, mono_ms()+1);	// the probes that are due go out in between
     return;
   }
+
+  for (c = 0; c < sizeof(parts)/sizeof(parts[0]); c++) {
+    metric_append(sn, parts[c]);
+    drop_snapshot(parts[c]);
+  }
+  if (sn->failed) drop_snapshot(sn);	// keep serving the previous one
   else {
-    tp->rttlast = r;
-    ampl = tp->okavg - tp->rttmin;
-    wattron(scroller, COLOR_PAIR(STATE_LOSS));
+    sn->headlen = snprintf(sn->head, sizeof(sn->head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                                       "Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)sn->len);
+    if (metrics) drop_snapshot(metrics);
+    metrics = sn;
   }
-
-  if (tp->id == showinfo) print_info();
-
-  print_scroll("%c  %-40.40s %-40s  %4d ms  (baseline %3d ± %2d)", tp->id, tp->name, tp->ipstr, r, tp->okavg, ampl);
-  update_screen('s');
+  sn = NULL;
+  timer_add(&timers, tm, started+METRICSREFRESH);
 }
 
-char *print_type(int t) {
-  static char *ttab[] = {
-                "Echo Reply",
-                "ICMP 1",
-                "ICMP 2",
-                "Dest Unreachable",
-                "Source Quench",
-                "Redirect",
-                "ICMP 6",
-                "ICMP 7",
-                "Echo",
-                "ICMP 9",
-                "ICMP 10",
-                "Time Exceeded",
-                "Parameter Problem",
-                "Timestamp",
-                "Timestamp Reply",
-                "Info Request",
-                "Info Reply"
-  };
-
-  if ((t < 0) || (t > 16)) return("OUT-OF-RANGE");
-
-  return ttab[t];
+void drop_snapshot(snapshot *sn) {
+  if (--sn->refs) return;
+  free(sn->text);
+  free(sn);
 }
 
-int read_targets(void) {
-  int i, r, rank, count = 0, detached = 0;
-  char buf[LINEBUF+1], *tmp2;
-  target *t, *tmp;
-  struct addrinfo hints, *res = NULL;
-  FILE *fp = NULL;
-
-  if (!(fp = fopen(TARGETSFILE, "r"))) {
-    perror("fopen()");
-    return -1;
-  }
-
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = PF_UNSPEC;
-  hints.ai_socktype = SOCK_RAW;
+void accept_client(void) {
+  int c, fd;
+  struct epoll_event ev;
 
-  while (fgets(buf, LINEBUF, fp)) {
-    for (rank = 0; buf[rank] == ' '; rank++);
-    if (!buf[rank]) return -1;
-    if (buf[rank] == '\n') {
-      detached = 1;
-      continue;
+  while ((fd = accept4(metricsfd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) != -1) {
+    for (c = 0; c < MAXCLIENTS; c++) {
+      if (clients[c].fd == -1) break;
     }
-    strtok(&buf[rank], " \n");
-    if ((r = getaddrinfo(&buf[rank], NULL, &hints, &res))) {
-      fprintf(stderr, "- %s getaddrinfo(): %s\n", &buf[rank], gai_strerror(r));
+    if (c == MAXCLIENTS) {	// busy; the scraper will try again
+      close(fd);
       continue;
     }
-    i = 0;
-    for (struct addrinfo *ai = res; ai; ai = ai->ai_next, i++) {
-      if (i == 10) {
-        fprintf(stderr, "- %s has more than 10 addresses, skipping...\n", &buf[rank]);
-        break;
-      }
+    clients[c].fd = fd;
+    clients[c].tail = 0;
+    clients[c].reqlen = 0;
+    clients[c].snap = NULL;
+    clients[c].off = 0;
+    timer_add(&timers, &clients[c].timer, mono_ms()+CLIENTTIMEOUT);
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+  }
+  if ((errno != EAGAIN) && (errno != EINTR)) perror("accept4()");
+}
 
-      if (!(t = (target *)malloc(sizeof(target)))) {
-        perror("malloc()");
-        return -1;
-      }
-      memset(t, 0, sizeof(target));
-      if (!(t->addr = (struct sockaddr_storage *)malloc(sizeof(struct sockaddr_storage)))) {
-        perror("malloc()");
-        return -1;
-      }
-      memset(t->addr, 0, sizeof(struct sockaddr_storage));
-      memcpy(t->addr, ai->ai_addr, sizeof(struct sockaddr_storage));
-      if ((r = getnameinfo(ai->ai_addr, ai->ai_addrlen, t->ipstr, 40, NULL, 0, NI_NUMERICHOST))) {
-        fprintf(stderr, "- %s getnameinfo(): %s\n", &buf[rank], gai_strerror(r));
-        continue;
-      }
-      if ((r = getnameinfo(ai->ai_addr, ai->ai_addrlen, t->name, HOSTLEN, NULL,0,0))) {
-        fprintf(stderr, "- %s getnameinfo(): %s\n", t->ipstr, gai_strerror(r));
-        snprintf(t->name, HOSTLEN, "(%s)", &buf[rank]);
-      }
-      t->num = ntargets;
-      t->id = IDSEQUENCE[count];
-      if (!t->id) t->id = '?';
-      t->rank = rank;
-      t->detached = detached;
-      if (detached) ndetach++;
-      t->rttmin = -1;
-      t->lastcolor = 99;
-      tmp2 = strtok(NULL, "\n");
-      if (tmp2) {
-        if (!(t->comment = (char *)malloc(strlen(tmp2)+1))) {
-          perror("malloc()");
-          return -1;
-        }
-        strcpy(t->comment, tmp2);
-        if (2*rank+strlen(tmp2)+1 > maxwidth) maxwidth = 2*rank+strlen(tmp2)+1;
-      }
-      else if (2*rank > maxwidth) maxwidth = 2*rank;
+void serve_client(int fd, int events) {
+  int c, r;
+  char buf[1024];
+  static char unavailable[] = "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+  client *cl;
 
-      if (!targets) targets = t;
-      else {
-        for (tmp = targets; tmp->next; tmp = tmp->next);
-        tmp->next = t;
+  for (c = 0; c < MAXCLIENTS; c++) {
+    if (clients[c].fd == fd) break;
+  }
+  if (c == MAXCLIENTS) return;
+  cl = &clients[c];
+
+  if (!cl->snap) {	// read up to the empty line that ends the request header
+    while (1) {
+      if ((r = read(fd, buf, sizeof(buf))) == -1) {
+        if ((errno == EAGAIN) || (errno == EINTR)) return;
+        close_client(cl);
+        return;
       }
-      ntargets++;
-      detached = 0;
-
-      if (t->comment) {
-        printf("%c %s [%s] (%s)\n", t->id, t->name, t->ipstr, t->comment);
+      if (!r || ((cl->reqlen += r) > 8192)) {
+        close_client(cl);
+        return;
       }
-      else {
-        printf("%c %s [%s]\n", t->id, t->name, t->ipstr);
+      for (c = 0; c < r; c++) {
+        cl->tail = (cl->tail << 8) | (unsigned char)buf[c];
+        if ((cl->tail == 0x0d0a0d0a) || ((cl->tail & 0xffff) == 0x0a0a)) break;
       }
+      if (c < r) break;
     }
+    if (!metrics) {	// the first snapshot couldn't be built, there's nothing to serve yet
+      send(fd, unavailable, sizeof(unavailable)-1, MSG_DONTWAIT|MSG_NOSIGNAL);
+      close_client(cl);
+      return;
+    }
+    cl->snap = metrics;
+    metrics->refs++;
+  }
+  send_metrics(cl);
+}
 
-    count++;
-    freeaddrinfo(res);
+void send_metrics(client *cl) {
+  ssize_t r;
+  snapshot *sn = cl->snap;
+  struct iovec iov[2];
+  struct msghdr msg;
+  struct epoll_event ev;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  if (cl->off < sn->headlen) {
+    iov[0].iov_base = sn->head+cl->off;
+    iov[0].iov_len = sn->headlen-cl->off;
+    iov[1].iov_base = sn->text;
+    iov[1].iov_len = sn->len;
+    msg.msg_iovlen = 2;
   }
+  else {
+    iov[0].iov_base = sn->text+cl->off-sn->headlen;
+    iov[0].iov_len = sn->len-(cl->off-sn->headlen);
+    msg.msg_iovlen = 1;
+  }
+  if ((r = sendmsg(cl->fd, &msg, MSG_DONTWAIT|MSG_NOSIGNAL)) == -1) {
+    if ((errno == EAGAIN) || (errno == EINTR)) r = 0;
+    else {
+      close_client(cl);
+      return;
+    }
+  }
+  cl->off += r;
+  if (cl->off == sn->headlen+sn->len) {
+    close_client(cl);
+    return;
+  }
+  ev.events = EPOLLOUT;	// the socket buffer is full, carry on when there's room
+  ev.data.fd = cl->fd;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, cl->fd, &ev);
+}
 
-  if (!ntargets) return -1;
+void client_timeout(timer *tm) {
+  close_client((client *)tm);
+}
 
-  return 0;
+void close_client(client *cl) {
+  timer_del(&cl->timer);
+  close(cl->fd);
+  cl->fd = -1;
+  if (cl->snap) drop_snapshot(cl->snap);
+  cl->snap = NULL;
 }
 
-void send_ping(target *t) {
-  int fd, len = sizeof(struct icmp6_hdr) + sizeof(struct timeval);
-  u_char packet[len];
-  struct timeval *tp;
+void send_ping(shard *sh, command *cm) {	// worker
+  int len = sizeof(struct icmp6_hdr) + sizeof(payload);
+  u_char *packet;
+  payload *pl;
+  sentprobe *sp;
+  txqueue *q = (cm->addr.sa.sa_family == AF_INET?&sh->txq4:&sh->txq6);
+
+  if (q->len == BATCHSIZE) flush_queue(sh, q);
+  packet = q->packet[q->len];
 
-  if (t->addr->ss_family == AF_INET) {
-    fd = sock4;
-    len = sizeof(struct icmp) + sizeof(struct timeval);
+  if (cm->addr.sa.sa_family == AF_INET) {
+    len = ICMP_MINLEN + sizeof(payload);
     struct icmp *icp = (struct icmp *)packet;
-    tp = (struct timeval *)&packet[8];
+    pl = (payload *)&packet[ICMP_MINLEN];
 
     icp->icmp_type = ICMP_ECHO;
     icp->icmp_code = 0;
-    icp->icmp_id = htons(pid);
-    icp->icmp_seq = htons(pinground);
-    gettimeofday(tp, NULL);
+    icp->icmp_id = htons(sh->id);
+    icp->icmp_seq = htons(cm->seq);
+    pl->tnum = cm->tnum;
+    pl->tseq = cm->tseq;
+    gettimeofday(&pl->sent, NULL);
     icp->icmp_cksum = 0;
     icp->icmp_cksum = calc_checksum(icp, len);
   }
   else {
-    fd = sock6;
     struct icmp6_hdr *icp = (struct icmp6_hdr *)packet;
-    tp = (struct timeval *)&packet[sizeof(struct icmp6_hdr)];
+    pl = (payload *)&packet[sizeof(struct icmp6_hdr)];
 
     icp->icmp6_type = ICMP6_ECHO_REQUEST;
     icp->icmp6_code = 0;
-    icp->icmp6_id = htons(pid);
-    icp->icmp6_seq = htons(pinground);
-    gettimeofday(tp, NULL);
+    icp->icmp6_id = htons(sh->id);
+    icp->icmp6_seq = htons(cm->seq);
+    pl->tnum = cm->tnum;
+    pl->tseq = cm->tseq;
+    gettimeofday(&pl->sent, NULL);
+  }
+
+  if (cm->size > sizeof(payload)) {	// zeroes don't change the checksum
+    q->iov[q->len][1].iov_base = padding;
+    q->iov[q->len][1].iov_len = cm->size-sizeof(payload);
+  }
+  else q->iov[q->len][1].iov_len = 0;
+
+  sp = &sh->sent[cm->seq%MAXINFLIGHT];
+  sp->seq = cm->seq;
+  sp->tnum = cm->tnum;
+  clock_gettime(CLOCK_REALTIME, &sp->sent);
+
+  memcpy(&q->addr[q->len], &cm->addr, sizeof(cm->addr));
+  q->seq[q->len] = cm->seq;
+  q->iov[q->len][0].iov_base = packet;
+  q->iov[q->len][0].iov_len = len;
+  memset(&q->msgs[q->len], 0, sizeof(struct mmsghdr));
+  q->msgs[q->len].msg_hdr.msg_name = &q->addr[q->len];
+  q->msgs[q->len].msg_hdr.msg_namelen = (cm->addr.sa.sa_family == AF_INET?sizeof(struct sockaddr_in):sizeof(struct sockaddr_in6));
+  q->msgs[q->len].msg_hdr.msg_iov = q->iov[q->len];
+  q->msgs[q->len].msg_hdr.msg_iovlen = (q->iov[q->len][1].iov_len?2:1);
+  q->len++;
+}
+
+void flush_queue(shard *sh, txqueue *q) {	// worker
+  int r, sent = 0;
+
+  while (sent < q->len) {
+    r = sendmmsg(q->fd, &q->msgs[sent], q->len-sent, 0);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      perror("sendmmsg()");
+      sent++;		// skip the packet that failed, like sendto() would have
+      continue;
+    }
+    count_batch(&sh->txstats, r);
+    if (timestamping == 2) {
+      for (; r; r--, sent++) q->keyseq[q->tskey++%MAXINFLIGHT] = q->seq[sent];
+    }
+    else sent += r;
   }
+  q->len = 0;
+}
 
-  if ((sendto(fd, packet, len, 0, (struct sockaddr *)t->addr, sizeof(struct sockaddr_storage))) <= 0) perror("sendto()");
+void flush_sends(void) {	// wakes up the workers that were given echo requests
+  int c;
+
+  for (c = 0; c < nshards; c++) ring_signal(&shards[c].cmds);
 }
 
 u_short calc_checksum(struct icmp *addr, int len) {
@@ -706,7 +3821,7 @@ u_short calc_checksum(struct icmp *addr, int len) {
 }
 
 void start_curses(void) {
-  int c, x, y, currid = 0;
+  int c;
 
   setlocale(LC_ALL, "");
   setenv("NCURSES_NO_UTF8_ACS", "1", 0);
@@ -728,11 +3843,11 @@ void start_curses(void) {
   init_pair(8, COLOR_CYAN, COLOR_BLACK);
 
   getmaxyx(stdscr, rows, cols);
-  if ((cols < 72) || (rows < 16)) {
+  if ((cols < 72) || (rows < 17)) {
     noraw();
     echo();
     endwin();
-    fprintf(stderr, "This program requires at least a 16*72 character display, yours has %d*%d\n", rows, cols);
+    fprintf(stderr, "This program requires at least a 17*72 character display, yours has %d*%d\n", rows, cols);
     exit(-17);
   }
 
@@ -741,7 +3856,7 @@ void start_curses(void) {
   footer = newwin(1, cols, rows-SCROLLSIZE-2, 0);
   scroller = newwin(SCROLLSIZE, cols, rows-SCROLLSIZE-1, 0);
   status = newwin(1, cols, rows-1, 0);
-  hostinfo = newwin(15, 51, (rows-15)/2, (cols-51)/2);
+  hostinfo = newwin(17, 51, (rows-17)/2, (cols-51)/2);
   tree = newwin(ntargets+ndetach+2, maxwidth+5, 1, cols-(maxwidth+5));
   downlist = newwin(2, 40, 1, cols-40-(maxwidth+5));
 
@@ -754,11 +3869,32 @@ void start_curses(void) {
   }
 
   leaveok(grid, TRUE);
-  scrollok(grid, TRUE);
   leaveok(scroller, TRUE);
   scrollok(scroller, TRUE);
   leaveok(status, TRUE);
 
+  print_ids();
+
+  draw_border(downlist, " Hosts down ");
+  if (maxwidth >= 12) draw_border(tree, " Network Map ");
+  else draw_border(tree, " Map ");
+  wattron(tree, COLOR_PAIR(5));
+  print_tree();
+  update_screen('h');
+
+  for (c = 0; c < SCROLLSIZE; c++) waddch(scroller, '\n');
+  wattron(scroller, COLOR_PAIR(8));
+  for (c = (nstartlines > SCROLLSIZE?nstartlines-SCROLLSIZE:0); c < nstartlines; c++) print_scroll("%s", startlines[c%SCROLLSIZE]);
+//  if (has_colors()) print_scroll("Terminal supports colors");
+//  if (can_change_color()) print_scroll("Terminal can change color definitions");
+}
+
+void print_ids(void) {	// the header and footer lines, for the hosts that fit
+  int c, x, y, paged = 0;
+  char buf[24];
+
+  wmove(header, 0, 0);
+  wmove(footer, 0, 0);
   wattron(header, COLOR_PAIR(5));
   wattron(footer, COLOR_PAIR(5));
   for (c = 0; c < 7; c++) {
@@ -767,36 +3903,136 @@ void start_curses(void) {
   }
   wattron(header, COLOR_PAIR(1));
   wattron(footer, COLOR_PAIR(1));
-  for (target *t = targets; t; t = t->next) {
-    if (t->id != currid) {
+  lastcol = fit_columns(firstcol, cols-8);
+  if (firstcol || (lastcol < ntargets)) {	// make room for the page indicator
+    lastcol = fit_columns(firstcol, cols-8-sizeof(buf));
+    paged = snprintf(buf, sizeof(buf), " < %d-%d/%d > ", firstcol+1, lastcol, ntargets);
+  }
+  for (c = firstcol; c < lastcol; c++) {
+    if ((c == firstcol) || strcmp(tlist[c]->id, tlist[c-1]->id)) {
       waddch(header, ' ');
       waddch(footer, ' ');
     }
-    currid = t->id;
-    waddch(header, currid);
-    waddch(footer, currid);
+    waddstr(header, tlist[c]->id);
+    waddstr(footer, tlist[c]->id);
   }
   waddch(header, ' ');
   waddch(footer, ' ');
   wattron(header, COLOR_PAIR(5));
   wattron(footer, COLOR_PAIR(5));
   getyx(header, y, x);
-  for (; x < cols; x++) {
+  for (; x < cols-paged; x++) {
     waddch(header, ACS_HLINE);
     waddch(footer, ACS_HLINE);
   }
+  if (paged) {
+    wattron(header, COLOR_PAIR(1));
+    waddstr(header, buf);
+    wattron(header, COLOR_PAIR(5));
+    for (; x < cols; x++) waddch(footer, ACS_HLINE);
+  }
+}
 
-  draw_border(downlist, " Hosts down ");
+int fit_columns(int first, int width) {	// the first host past the ones that fit in width
+  int c, x;
+
+  for (c = first, x = 0; c < ntargets; c++) {
+    if ((c == first) || strcmp(tlist[c]->id, tlist[c-1]->id)) x++;
+    if (x+idwidth > width) break;
+    x += idwidth;
+  }
+  return c;
+}
+
+void page_grid(int dir) {	// '<' and '>' move the grid a screen width through the hosts
+  int c, x;
+
+  if (dir > 0) {
+    if (lastcol >= ntargets) return;
+    firstcol = lastcol;
+  }
+  else {
+    if (!firstcol) return;
+    for (c = firstcol-1, x = 0; c >= 0; c--) {	// as many as fit before it, next to the page indicator
+      if (!c || strcmp(tlist[c]->id, tlist[c-1]->id)) x++;
+      if ((x += idwidth) > cols-8-24) break;
+    }
+    firstcol = c+1;
+  }
+  print_ids();
+  update_screen('h');
+}
+
+void print_grid(void) {	// only the hosts and passes that fit, so a frame costs the same for any number of hosts
+  int c, x, row, pass, height, width, color;
+  char buf[8];
+  struct tm *tm;
+  target *tp;
+
+  if (headless) return;
+  getmaxyx(grid, height, width);
+  werase(grid);
+  for (row = 0; (row < height) && (row < HISTLOG) && (row < pinground); row++) {
+    pass = (currlog-row+HISTLOG)%HISTLOG;
+    tm = localtime(&hist->passtime[pass]);
+    snprintf(buf, sizeof(buf), "[%02d:%02d]", tm->tm_hour, tm->tm_min);
+    mvwaddstr(grid, height-1-row, 0, buf);
+    for (c = firstcol, x = 7; (c < lastcol) && (x < width); c++) {
+      tp = tlist[c];
+      if ((c == firstcol) || strcmp(tp->id, tlist[c-1]->id)) x++;
+      color = histlog[pass].data[tp->num].color;
+      if (color) mvwaddch(grid, height-1-row, x, GRIDMARK|COLOR_PAIR(color));
+      else if (!row && (tp->lastround == pinground)) mvwaddch(grid, height-1-row, x, GRIDMARK|COLOR_PAIR(1));	// in flight
+      x += idwidth;
+    }
+  }
+}
+
+void make_id(char *id, int n) {	// n in base strlen(IDSEQUENCE), idwidth digits
+  int c, base = strlen(IDSEQUENCE);
+
+  for (c = idwidth-1; c >= 0; c--) {
+    id[c] = IDSEQUENCE[n%base];
+    n /= base;
+  }
+  id[idwidth] = '\0';
+}
+
+void redraw_targets(void) {	// after a reload; of the map only the rows that changed are redrawn
+  int y, x, height = ntargets+ndetach+2, width = maxwidth+5;
+  chtype *was, *now;
+  WINDOW *drawn = tree;
+
+  if (headless) return;
+  print_ids();
+  tree = newwin(height, width, 1, cols-width);	// the new map, off screen
   if (maxwidth >= 12) draw_border(tree, " Network Map ");
   else draw_border(tree, " Map ");
   wattron(tree, COLOR_PAIR(5));
   print_tree();
-  update_screen('h');
-
-  for (c = 0; c < SCROLLSIZE; c++) waddch(scroller, '\n');
-  for (c = 0; c < rows-SCROLLSIZE; c++) waddch(grid, '\n');
-//  if (has_colors()) print_scroll("Terminal supports colors");
-//  if (can_change_color()) print_scroll("Terminal can change color definitions");
+  getmaxyx(drawn, y, x);
+  if ((y != height) || (x != width)) {	// it changed size, so all of it and what was under it
+    delwin(drawn);
+    if (showtree) mvwin(downlist, 1, cols-40-width);
+    else mvwin(downlist, 1, cols-40);
+    update_screen('h');
+    return;
+  }
+  if ((was = (chtype *)malloc(2*(width+1)*sizeof(chtype)))) {
+    now = was+width+1;
+    for (y = 0; y < height; y++) {
+      mvwinchnstr(drawn, y, 0, was, width);
+      mvwinchnstr(tree, y, 0, now, width);
+      if (memcmp(was, now, width*sizeof(chtype))) copywin(tree, drawn, y, 0, y, 0, y, width-1, FALSE);
+    }
+    free(was);
+    delwin(tree);
+    tree = drawn;
+  }
+  else delwin(drawn);
+  dirty |= 1<<0|1<<1;	// the header and footer, without repainting everything
+  update_screen('g');
+  update_screen('t');
 }
 
 void draw_border(WINDOW *win, char *title) {
@@ -832,6 +4068,7 @@ void print_scroll(char *fmt, ...) {
   char buf[cols+1];
   va_list arglist;
 
+  if (headless) return;
   va_start(arglist, fmt);
   vsnprintf(buf, cols, fmt, arglist);
   va_end(arglist);
@@ -839,6 +4076,7 @@ void print_scroll(char *fmt, ...) {
   waddch(scroller, '\n');
   waddstr(scroller, buf);
   wclrtoeol(scroller);
+  update_screen('s');
 }
 
 void print_status(char *fmt, ...) {
@@ -846,6 +4084,7 @@ void print_status(char *fmt, ...) {
   char buf[cols+1];
   va_list arglist;
 
+  if (headless) return;
   va_start(arglist, fmt);
   vsnprintf(buf, cols, fmt, arglist);
   va_end(arglist);
@@ -865,29 +4104,22 @@ void print_status(char *fmt, ...) {
   for (; x < cols; x++) waddch(status, ACS_HLINE);
 }
 
-void print_tree(void) {
-  int c, d, n, more, nextrank, detach1 = 0, detach2;
+void print_round(void) {	// the status line, drawn by draw_screen()
+  print_status("Ping round %d / Monitoring %d hosts / Estimated local latency: %s ms / Packets per batch: rx %.1f tx %.1f / Queue: avg %.1f max %u / Filtered: ~%lu",
+    pinground, ntargets, ustoms(rstats.ell), rstats.rxbatch, rstats.txbatch, rstats.qdepth, rstats.qmax, rstats.filtered);
+}
+
+void print_tree(void) {	// draws the whole map, after that only print_treehost() is needed
+  int y, d;
   char *cp;
-  target *t1, *t2, *t3;
-
-  wmove(tree, 1, 2);
-  for (n = 0, t1 = targets; t1; n++, t1 = t1->next) {
-    wmove(tree, n+1+detach1, 2*t1->rank+2);
-    switch (t1->treecolor) {
-      case 3: waddch(tree, t1->id|COLOR_PAIR(STATE_OK));
-              break;
-      case 4: waddch(tree, t1->id|COLOR_PAIR(STATE_JIT));
-              break;
-      case 5: waddch(tree, t1->id|COLOR_PAIR(STATE_LAG));
-              break;
-      case 6: waddch(tree, t1->id|COLOR_PAIR(STATE_LOSS));
-              break;
-      default: waddch(tree, t1->id|COLOR_PAIR(1));
-    }
-    if (t1->comment) {
+  target *tp;
+
+  if (headless) return;
+  for (tp = targets; tp; tp = tp->next) {
+    print_treehost(tp);
+    if (tp->comment) {
       waddch(tree, ' ');
-      wattron(tree, COLOR_PAIR(1));
-      for (cp = t1->comment; *cp; cp++) {
+      for (cp = tp->comment; *cp; cp++) {
         switch (*cp) {
           case '\'': waddch(tree, ACS_ULCORNER|COLOR_PAIR(5));
                     break;
@@ -901,172 +4133,177 @@ void print_tree(void) {
                     break;
           case '/': waddch(tree, ACS_LRCORNER|COLOR_PAIR(5));
                     break;
-          default: waddch(tree, *cp);
+          default: waddch(tree, *cp|COLOR_PAIR(1));
         }
       }
-      wattron(tree, COLOR_PAIR(5));
-    }
-
-    for (c = n+1, nextrank = 100, detach2 = detach1, t2 = t1->next; t2; c++, t2 = t2->next, more = 0) {
-      if (t2->rank <= t1->rank) break;
-      if (t2->detached) {
-        wmove(tree, c+1+detach2, 2*t1->rank+2);
-        waddch(tree, ACS_VLINE);
-        detach2++;
-      }
-      if (t2->rank < nextrank) nextrank = t2->rank;
-      for (t3 = t2->next; t3; t3 = t3->next) {
-        if (t3->rank <= t1->rank) break;
-        if (t3->rank <= nextrank) more = 1;
-      }
-      wmove(tree, c+1+detach2, 2*t1->rank+2);
-      if (t2->rank <= nextrank) {
-        d = (t2->rank-t1->rank)*2-1;
-        if (more) waddch(tree, ACS_LTEE);
-        else waddch(tree, ACS_LLCORNER);
-        while (d--) waddch(tree, ACS_HLINE);
-      }
-      else if (more) waddch(tree, ACS_VLINE);
-      if (!more) break;
     }
-    if (t1->next && t1->next->detached) detach1++;
+    if (!tp->parent) continue;
+    for (y = tp->treeline; y < tp->treey; y++) mvwaddch(tree, y, tp->parent->treex, ACS_VLINE|COLOR_PAIR(5));
+    wmove(tree, tp->treey, tp->parent->treex);
+    waddch(tree, (tp->parent->lastkid == tp?ACS_LLCORNER:ACS_LTEE)|COLOR_PAIR(5));
+    for (d = (tp->rank-tp->parent->rank)*2-1; d; d--) waddch(tree, ACS_HLINE|COLOR_PAIR(5));
   }
 }
 
+void print_treehost(target *tp) {
+  int color = tp->st->treecolor;
+  char *cp;
+
+  if (headless) return;
+  if ((color < STATE_OK) || (color > STATE_LOSS)) color = 1;
+  wmove(tree, tp->treey, tp->treex);
+  for (cp = tp->id; *cp; cp++) waddch(tree, *cp|COLOR_PAIR(color));
+  update_screen('t');
+}
+
 void print_info(void) {
   char buf[48];
-  float stddev;
-  target *tp;
+  double stddev = 0;
+  target *tp = showinfo;
   logdata *ld;
 
-  for (tp = targets; tp; tp = tp->next) {
-    if (tp->id == showinfo) break;
-  }
-  if (!tp || !pinground) return;
+  if (headless) return;
+  if (!tp || !tp->st->probecount) return;
 
-  ld = get_logdata(tp->num);
+  ld = get_logdata(tp);
 
 //  print_scroll("get_logdata returned: count = %d / min = %d / avg = %d / max = %d / okavg = %d / delaycount = %d / losscount = %d", ld->count, ld->rttmin, ld->rttavg, ld->rttmax, ld->okavg, ld->delaycount, ld->losscount);
 
   werase(hostinfo);
   draw_border(hostinfo, " Host info ");
 
-  stddev = sqrtf(tp->sqsum/pinground-pow(tp->rttavg,2));
+  if (tp->st->probecount+tp->st->latecount > tp->st->losscount) {
+    stddev = (double)tp->st->rttsum/(tp->st->probecount-tp->st->losscount+tp->st->latecount);
+    stddev = tp->st->sqsum/(tp->st->probecount-tp->st->losscount+tp->st->latecount) - stddev*stddev;
+    stddev = stddev > 0?sqrt(stddev):0;
+  }
 
-  if (strlen(tp->name)+strlen(tp->ipstr)+5 < 48) snprintf(buf, 48, "%c %s (%s)", tp->id, tp->name, tp->ipstr);
-  else snprintf(buf, 48, "%c %s", tp->id, tp->name);
+  if (strlen(tp->name)+strlen(tp->ipstr)+5 < 48) snprintf(buf, 48, "%s %s (%s)", tp->id, tp->name, tp->ipstr);
+  else snprintf(buf, 48, "%s %s", tp->id, tp->name);
   mvwaddstr(hostinfo, 1, 2, buf);
-  snprintf(buf, 48, "Overall statistics     | Last %d minutes", HISTLOG*INTERVAL/60);
+  snprintf(buf, 48, "Overall statistics     | Last %d minutes", HISTLOG*interval/60);
   mvwaddstr(hostinfo, 2, 2, buf);
-  snprintf(buf, 48, "Baseline: %5d ± %-4d | %5d ± %-4d", tp->okavg, tp->okavg-tp->rttmin, ld->okavg, ld->okavg-ld->rttmin);
+  snprintf(buf, 48, "Baseline:%5s ± %-5s | %5s ± %-5s", ustoms(tp->st->okavg), ustoms(tp->st->okdev), ustoms(ld->okavg), ustoms(ld->okavg-ld->rttmin));
   mvwaddstr(hostinfo, 3, 2, buf);
-  snprintf(buf, 48, "Min:          %5d    | %5d", tp->rttmin, ld->rttmin);
+  snprintf(buf, 48, "Min:          %5s    | %5s", ustoms(tp->st->rttmin), ustoms(ld->rttmin));
   mvwaddstr(hostinfo, 4, 2, buf);
-  snprintf(buf, 48, "Avg:          %5d    | %5d", tp->rttavg, ld->rttavg);
+  snprintf(buf, 48, "Avg:          %5s    | %5s", ustoms(tp->st->rttavg), ustoms(ld->rttavg));
   mvwaddstr(hostinfo, 5, 2, buf);
   //if (!stddev)
-  snprintf(buf, 47, "Max:          %5d    | %5d", tp->rttmax, ld->rttmax);
-  //else snprintf(buf, 48, "Max:          %5d %ds |     x", tp->rttmax, (int)((tp->rttmax-tp->rttavg)/sqrt(tp->varsum/pinground)+1));
+  snprintf(buf, 47, "Max:          %5s    | %5s", ustoms(tp->st->rttmax), ustoms(ld->rttmax));
+  //else snprintf(buf, 48, "Max:          %5d %ds |     x", tp->st->rttmax, (int)((tp->st->rttmax-tp->st->rttavg)/sqrt(tp->varsum/pinground)+1));
   mvwaddstr(hostinfo, 6, 2, buf);
-  snprintf(buf, 48, "Last:         %5d", tp->rttlast);
+  snprintf(buf, 48, "Last:         %5s    | Timeout: %s", ustoms(tp->st->rttlast), ustoms(tp->st->rto));
   mvwaddstr(hostinfo, 7, 2, buf);
-  snprintf(buf, 48, "Std.Dev.:        %5.2f |    %5.2f", stddev, ld->stddev);
+  snprintf(buf, 48, "Std.Dev.:     %5s    | %5s", ustoms(stddev), ustoms(ld->stddev));
   mvwaddstr(hostinfo, 8, 2, buf);
-  snprintf(buf, 48, "Probes delayed: %5.1f%% |   %5.1f%%", tp->delaycount*100.0/pinground, ld->count?ld->delaycount*100.0/ld->count:0.0);
+  snprintf(buf, 48, "p50/p90:  %5s %5s  | %5s %5s", ustoms(sketch_quantile(&tp->st->quant, 0.5, tp->st->rttmin, tp->st->rttmax)), ustoms(sketch_quantile(&tp->st->quant, 0.9, tp->st->rttmin, tp->st->rttmax)),
+    ustoms(sketch_quantile(&tp->win.quant, 0.5, ld->rttmin, ld->rttmax)), ustoms(sketch_quantile(&tp->win.quant, 0.9, ld->rttmin, ld->rttmax)));
   mvwaddstr(hostinfo, 9, 2, buf);
-  snprintf(buf, 48, "Probes lost:    %5.1f%% |   %5.1f%%", tp->losscount*100.0/pinground, ld->count?ld->losscount*100.0/ld->count:0.0);
+  snprintf(buf, 48, "p99/99.9: %5s %5s  | %5s %5s", ustoms(sketch_quantile(&tp->st->quant, 0.99, tp->st->rttmin, tp->st->rttmax)), ustoms(sketch_quantile(&tp->st->quant, 0.999, tp->st->rttmin, tp->st->rttmax)),
+    ustoms(sketch_quantile(&tp->win.quant, 0.99, ld->rttmin, ld->rttmax)), ustoms(sketch_quantile(&tp->win.quant, 0.999, ld->rttmin, ld->rttmax)));
   mvwaddstr(hostinfo, 10, 2, buf);
-  snprintf(buf, 48, "Warning bell: %s", tp->beepmode?tp->beepmode==1?"inverse":"off":"on");
+  snprintf(buf, 48, "Dly/loss:%5.1f%%%6.1f%% |%6.1f%%%6.1f%%", tp->st->delaycount*100.0/tp->st->probecount, tp->st->losscount*100.0/tp->st->probecount,
+    ld->count?ld->delaycount*100.0/ld->count:0.0, ld->count?ld->losscount*100.0/ld->count:0.0);
   mvwaddstr(hostinfo, 11, 2, buf);
-  snprintf(buf, 48, "Current status: %s", tp->treecolor==STATE_LOSS?"down":"up");
+  snprintf(buf, 48, "Current status: %-4s   | Warning bell: %s", tp->st->treecolor==STATE_LOSS?"down":down_above(tp)?"behind":"up", tp->st->beepmode?tp->st->beepmode==1?"inverse":"off":"on");
   mvwaddstr(hostinfo, 12, 2, buf);
+  snprintf(buf, 48, "Replies late: %u, dup: %u, reordered: %u", tp->st->latecount, tp->st->dupcount, tp->st->reordercount);
+  mvwaddstr(hostinfo, 13, 2, buf);
+  if (tp->lastkid) {	// group status of the hosts behind it
+    snprintf(buf, 48, "Behind it: %u down, %u losing, %+.1f ms", tp->sub.down-tp->own.down, tp->sub.losing-tp->own.losing,
+      tp->sub.replied-tp->own.replied?(double)(tp->sub.excess-tp->own.excess)/(tp->sub.replied-tp->own.replied)/1000:0.0);
+    mvwaddstr(hostinfo, 14, 2, buf);
+  }
+  if (tp->train && tp->train->packets) {
+    snprintf(buf, 48, "Trains of %d: lost %5.1f%%, jitter %s ms", tp->train->len, tp->train->lost*100.0/tp->train->packets, ustoms(tp->train->jitter));
+    mvwaddstr(hostinfo, 15, 2, buf);
+  }
 }
 
-void print_down(void) {
-  int ccols, crows, line = 1;
-  char buf[48];
+void print_down(void) {	// hosts behind a host that is down are only counted
+  int ccols, crows, line = 1, shown = 0;
+  char buf[48], behind[8];
   target *tp;
 
+  if (headless) return;
+  for (tp = targets; tp; tp = tp->next) {
+    if (tp->own.down && !down_above(tp)) shown++;
+  }
   getmaxyx(downlist, crows, ccols);
-  if (crows-2 != ndown) {
+  if (crows-2 != shown) {
     delwin(downlist);
-    if (showtree) downlist = newwin(ndown+2, 40, 1, cols-40-(maxwidth+5));
-    else downlist = newwin(ndown+2, 40, 1, cols-40);
+    if (showtree) downlist = newwin(shown+2, 40, 1, cols-40-(maxwidth+5));
+    else downlist = newwin(shown+2, 40, 1, cols-40);
     draw_border(downlist, " Hosts down ");
   }
   for (tp = targets; tp; tp = tp->next) {
-    if (tp->treecolor == STATE_LOSS) {
-      snprintf(buf, 48, "%c %-25.25s %s", tp->id, tp->name, itodur((int)time(NULL)-tp->downsince));
+    if (tp->own.down && !down_above(tp)) {
+      if (tp->sub.down > 1) snprintf(behind, 8, "+%u", tp->sub.down-1);
+      else behind[0] = '\0';
+      snprintf(buf, 48, "%-*s %-*.*s %4s %s", idwidth, tp->id, 21-idwidth, 21-idwidth, tp->name, behind, itodur((int)time(NULL)-tp->st->downsince));
       mvwaddstr(downlist, line++, 2, buf);
     }
   }
 }
 
-void update_screen(int win) {
-  switch (win) {
-    case 'h': touchwin(header);
-              wnoutrefresh(header);
-    case 'f': touchwin(footer);
-              wnoutrefresh(footer);
-    case 'a': touchwin(status);
-              wnoutrefresh(status);
-    case 'g': touchwin(grid);
-              wnoutrefresh(grid);
-    case 's': touchwin(scroller);
-              wnoutrefresh(scroller);
-    case 't': if (showtree) {
-                touchwin(tree);
-                wnoutrefresh(tree);
-              }
-    case 'd': if ((showdown == 2) || (showdown && ndown)) {
-                touchwin(downlist);
-                wnoutrefresh(downlist);
-              }
-    case 'i': if (showinfo) {
-                touchwin(hostinfo);
-                wnoutrefresh(hostinfo);
-              }
-    default:  doupdate();
-  }
-}
-
-logdata *get_logdata(int num) {
-  int i, okcount = 0;
-  unsigned int totsum = 0, oksum = 0;
-  float sqsum = 0;
-  static logdata res;
+void update_screen(int win) {	// marks a window for draw_screen(), which runs at most fps times per second
+  char *cp;
 
-  memset(&res, 0, sizeof(logdata));
-  res.rttmin = -1;
+  if (headless) return;
+  if ((win == 'h') || (win == 'f')) dirty |= 0xff|DIRTY_TOUCH;
+  else if ((cp = strchr(WINORDER, win))) dirty |= 1<<(cp-WINORDER);
+  if (!drawtimer.next) timer_add(&timers, &drawtimer, lastframe+1000/fps);
+}
 
-  for (i = 0; i < HISTLOG; i++) {
-    if (!histlog[i].data[num].color) {					// Might be current ping round
-      if ((++i == HISTLOG) || (!histlog[i].data[num].color)) break;	// or the end of the (used) histlog
-    }
-    res.count++;
-    if (histlog[i].data[num].color == STATE_LOSS) res.losscount++;
-    else {
-      totsum += histlog[i].data[num].rtt;
-      sqsum += powf(histlog[i].data[num].rtt,2);
-      if (histlog[i].data[num].rtt < res.rttmin) res.rttmin = histlog[i].data[num].rtt;
-      if (histlog[i].data[num].rtt > res.rttmax) res.rttmax = histlog[i].data[num].rtt;
-      if (histlog[i].data[num].color == STATE_LAG) res.delaycount++;
-      else if (histlog[i].data[num].color != STATE_JIT) {
-        oksum += histlog[i].data[num].rtt;
-        okcount++;
-      }
-    }
-  };
-  if (res.count) res.rttavg = totsum/res.count;
-  else res.rttavg = 0;
-  if (okcount) res.okavg = oksum/okcount;
-  else res.okavg = 0;
-  if (sqsum) {		// if sqsum != 0 then there must've been a non-loss result and thus res.count > res.losscount
-    res.stddev = sqsum/(res.count-res.losscount);	// preventing a division by zero here
-    res.stddev = res.stddev - powf(res.rttavg,2);
-    res.stddev = sqrtf(res.stddev);
+void draw_screen(timer *tm) {	// the callback of drawtimer
+  int c, below = 0;
+  static int drawndown = 0;
+  WINDOW *win[8];
+
+  if (dirty & 1<<6) {
+    if (ndown != drawndown) dirty |= DIRTY_TOUCH;	// the list changes size
+    drawndown = ndown;
+    print_down();
   }
-  else res.stddev = 0;
+  if (dirty & 1<<7) print_info();
+  if (dirty & 1<<3) print_grid();
+  if (dirty & 1<<2) print_round();
+
+  win[0] = header;
+  win[1] = footer;
+  win[2] = status;
+  win[3] = grid;
+  win[4] = scroller;
+  win[5] = showtree?tree:NULL;
+  win[6] = ((showdown == 2) || (showdown && ndown))?downlist:NULL;
+  win[7] = showinfo?hostinfo:NULL;
+  for (c = 0; c < 8; c++) {
+    if (!win[c]) continue;
+    if ((c >= 5) && below) dirty |= 1<<c;	// the overlays have to go back on top of what was drawn under them
+    if (!(dirty & (1<<c|DIRTY_TOUCH))) continue;
+    if ((c >= 5) || (dirty & DIRTY_TOUCH)) touchwin(win[c]);
+    wnoutrefresh(win[c]);
+    below = 1;
+  }
+  doupdate();
+  dirty = 0;
+  lastframe = mono_ms();
+}
+
+logdata *get_logdata(target *tp) {
+  static logdata res;
+  window *w = &tp->win;
+
+  memset(&res, 0, sizeof(logdata));
+  res.count = w->count;
+  res.losscount = w->losscount;
+  res.delaycount = w->delaycount;
+  res.rttmin = w->minlen?histlog[round_pass(w->minq[w->minhead])].data[tp->num].rtt:-1;
+  res.rttmax = w->maxlen?histlog[round_pass(w->maxq[w->maxhead])].data[tp->num].rtt:0;
+  res.rttavg = w->mean;
+  res.okavg = w->okcount?w->oksum/w->okcount:0;
+  res.stddev = w->n?sqrt(w->m2/w->n):0;
 
   return &res;
 }
@@ -1087,6 +4324,19 @@ char *itoa(int digits) {
    return buf;
 }
 
+char *ustoms(unsigned int us) {	// microseconds as milliseconds, 4 significant digits
+  static char buf[8][12];
+  static int n = 0;
+  char *bp = buf[n++%8];	// a few of these can be used in one printf
+
+  if (us == UINT_MAX) strcpy(bp, "-");
+  else if (us < 10000) snprintf(bp, 12, "%.3f", us/1000.0);
+  else if (us < 100000) snprintf(bp, 12, "%.2f", us/1000.0);
+  else if (us < 1000000) snprintf(bp, 12, "%.1f", us/1000.0);
+  else snprintf(bp, 12, "%u", us/1000);
+  return bp;
+}
+
 char *itodur(int digits) {
    static char buf[9];
    static int delta[] = { 31449600, 604800, 86400, 3600, 60 };
@@ -1115,10 +4365,16 @@ char *itodur(int digits) {
 }
 
 void do_exit(int sig) {
-  target *tp;
+  int c;
 
-  close(sock4);
-  close(sock6);
+  for (c = 0; c < nshards; c++) {
+    close(shards[c].sock4);
+    close(shards[c].sock6);
+  }
+  msync(hist, histsize, MS_SYNC);
+  if (logfd != -1) flush_log(NULL);
+  if (metricspath) unlink(metricspath);
+  if (headless) exit(0);
 
   noraw();
   echo();
@@ -1148,16 +4404,16 @@ void got_winch(void) {
   footer = resize_win(footer, 1, cols, rows-SCROLLSIZE-2, 0, 1);
   scroller = resize_win(scroller, SCROLLSIZE, cols, rows-SCROLLSIZE-1, 0, 7);
   status = resize_win(status, 1, cols, rows-1, 0, 1);
-  mvwin(hostinfo, (rows-10)/2, (cols-50)/2);
+  mvwin(hostinfo, (rows-17)/2, (cols-51)/2);
   mvwin(tree, 1, cols-(maxwidth+5));
   if (showtree) mvwin(downlist, 1, cols-40);
   else mvwin(downlist, 1, cols-40-(maxwidth+5));
 
   leaveok(grid, TRUE);
-  scrollok(grid, TRUE);
   leaveok(scroller, TRUE);
   scrollok(scroller, TRUE);
   leaveok(status, TRUE);
+  print_ids();
 
   clearok(curscr, TRUE);
   update_screen('h');
@@ -0,0 +1,208 @@
+// ICMP echo responder for 'make benchmark': answers echo requests to any address after a delay with optional jitter, and drops a share
+// Run it in a network namespace with net.ipv4.icmp_echo_ignore_all set, so the kernel doesn't answer them as well
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+
+#define MAXPENDING	262144		/* Replies waiting for their delay to pass */
+#define MAXPACKET	  1500
+#define BATCHSIZE	    64
+
+typedef struct reply {
+  unsigned long due;		// CLOCK_MONOTONIC, nanoseconds
+  int len;
+  u_char packet[MAXPACKET];	// IP header and ICMP echo reply
+} reply;
+
+reply **heap;			// binary heap of pending replies, earliest first
+int npending = 0;
+unsigned long received = 0, dropped = 0, answered = 0, overflow = 0, latesum = 0;
+volatile sig_atomic_t stop = 0;
+
+unsigned long mono_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000UL + ts.tv_nsec;
+}
+
+u_short cksum(u_short *p, int len) {
+  unsigned long sum = 0;
+
+  for (; len > 1; len -= 2) sum += *p++;
+  if (len) sum += *(u_char *)p;
+  sum = (sum >> 16) + (sum & 0xffff);
+  sum += sum >> 16;
+  return ~sum;
+}
+
+void heap_push(reply *rp) {
+  int c = npending++, parent;
+
+  for (; c; c = parent) {
+    parent = (c-1)/2;
+    if (heap[parent]->due <= rp->due) break;
+    heap[c] = heap[parent];
+  }
+  heap[c] = rp;
+}
+
+reply *heap_pop(void) {
+  reply *top = heap[0], *last = heap[--npending];
+  int c = 0, kid;
+
+  while ((kid = 2*c+1) < npending) {
+    if ((kid+1 < npending) && (heap[kid+1]->due < heap[kid]->due)) kid++;
+    if (last->due <= heap[kid]->due) break;
+    heap[c] = heap[kid];
+    c = kid;
+  }
+  if (npending) heap[c] = last;
+  return top;
+}
+
+reply *make_reply(u_char *buf, int len, unsigned long due) {	// NULL if it isn't an echo request
+  struct ip *ip = (struct ip *)buf, *rip;
+  struct icmp *icp;
+  int hlen = ip->ip_hl*4;
+  reply *rp;
+
+  if ((len < hlen+ICMP_MINLEN) || (len > MAXPACKET)) return NULL;
+  icp = (struct icmp *)(buf+hlen);
+  if (icp->icmp_type != ICMP_ECHO) return NULL;
+  if (!(rp = (reply *)malloc(sizeof(reply)))) return NULL;
+  rp->due = due;
+  rp->len = sizeof(struct ip)+len-hlen;	// without IP options
+  rip = (struct ip *)rp->packet;
+  memcpy(rip, ip, sizeof(struct ip));
+  rip->ip_hl = sizeof(struct ip)/4;
+  rip->ip_len = htons(rp->len);
+  rip->ip_src = ip->ip_dst;		// answer from the address that was probed
+  rip->ip_dst = ip->ip_src;
+  rip->ip_ttl = 64;
+  rip->ip_sum = 0;
+  memcpy(rp->packet+sizeof(struct ip), icp, len-hlen);
+  icp = (struct icmp *)(rp->packet+sizeof(struct ip));
+  icp->icmp_type = ICMP_ECHOREPLY;
+  icp->icmp_cksum = 0;
+  icp->icmp_cksum = cksum((u_short *)icp, len-hlen);
+  return rp;
+}
+
+void send_due(int sock, unsigned long now) {
+  struct sockaddr_in sin;
+  reply *rp;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  while (npending && (heap[0]->due <= now)) {
+    rp = heap_pop();
+    sin.sin_addr = ((struct ip *)rp->packet)->ip_dst;
+    if (sendto(sock, rp->packet, rp->len, 0, (struct sockaddr *)&sin, sizeof(sin)) == rp->len) {
+      answered++;
+      latesum += mono_ns()-rp->due;
+    }
+    free(rp);
+  }
+}
+
+void do_stop(int sig) {
+  stop = 1;
+}
+
+int main(int argc, char *argv[]) {
+  int c, n, in, out;
+  double delay = 0, jitter = 0, loss = 0;
+  unsigned long now, wait;
+  struct pollfd pfd;
+  struct timespec ts;
+  struct mmsghdr msgs[BATCHSIZE];
+  struct iovec iov[BATCHSIZE];
+  static u_char bufs[BATCHSIZE][MAXPACKET];
+  reply *rp;
+
+  while ((c = getopt(argc, argv, "d:j:l:")) != -1) {
+    switch (c) {
+      case 'd': delay = atof(optarg);
+                break;
+      case 'j': jitter = atof(optarg);
+                break;
+      case 'l': loss = atof(optarg);
+                break;
+      default:  fprintf(stderr, "Usage: %s [-d delay ms] [-j jitter ms] [-l loss %%]\n", argv[0]);
+                exit(-2);
+    }
+  }
+
+  if ((in = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP)) == -1) {
+    perror("socket()");
+    exit(-1);
+  }
+  if ((out = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) == -1) {	// implies IP_HDRINCL
+    perror("socket()");
+    exit(-1);
+  }
+  c = 8*1024*1024;
+  setsockopt(in, SOL_SOCKET, SO_RCVBUF, &c, sizeof(c));
+  setsockopt(out, SOL_SOCKET, SO_SNDBUF, &c, sizeof(c));
+  prctl(PR_SET_TIMERSLACK, 1);	// wake up on time for the replies that are due
+  if (!(heap = (reply **)malloc(MAXPENDING*sizeof(reply *)))) {
+    perror("malloc()");
+    exit(-1);
+  }
+  signal(SIGINT, do_stop);
+  signal(SIGTERM, do_stop);
+  srandom(getpid());
+
+  for (c = 0; c < BATCHSIZE; c++) {
+    iov[c].iov_base = bufs[c];
+    iov[c].iov_len = MAXPACKET;
+    memset(&msgs[c].msg_hdr, 0, sizeof(struct msghdr));
+    msgs[c].msg_hdr.msg_iov = &iov[c];
+    msgs[c].msg_hdr.msg_iovlen = 1;
+  }
+  pfd.fd = in;
+  pfd.events = POLLIN;
+
+  while (!stop) {
+    now = mono_ns();
+    send_due(out, now);
+    wait = npending?heap[0]->due-now:1000000000UL;	// the heap is due in the future now
+    ts.tv_sec = wait/1000000000UL;
+    ts.tv_nsec = wait%1000000000UL;
+    if (ppoll(&pfd, 1, &ts, NULL) < 1) continue;
+    if ((n = recvmmsg(in, msgs, BATCHSIZE, MSG_DONTWAIT, NULL)) < 1) continue;
+    now = mono_ns();
+    for (c = 0; c < n; c++) {
+      rp = make_reply(bufs[c], msgs[c].msg_len, now + (unsigned long)((delay + jitter*random()/RAND_MAX)*1000000));
+      if (!rp) continue;	// our own replies come by too
+      received++;
+      if (random() < loss/100*RAND_MAX) {
+        dropped++;
+        free(rp);
+        continue;
+      }
+      if (npending == MAXPENDING) {
+        overflow++;
+        free(rp);
+        continue;
+      }
+      heap_push(rp);
+    }
+  }
+
+  printf("{ \"received\": %lu, \"dropped\": %lu, \"answered\": %lu, \"overflow\": %lu, \"late_us\": %.1f }\n",
+    received, dropped, answered, overflow, answered?latesum/1e3/answered:0.0);
+  return 0;
+}